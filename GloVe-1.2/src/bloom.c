@@ -0,0 +1,56 @@
+//  Blocked Bloom filter used by cooccur to reject out-of-vocabulary tokens
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdlib.h>
+#include <math.h>
+#include "bloom.h"
+
+BLOOM *bloom_create(long long n, double fpr) {
+    BLOOM *bf;
+    double bits;
+    if (n < 1) n = 1;
+    if (fpr <= 0 || fpr >= 1) return NULL;
+    bf = malloc(sizeof(BLOOM));
+    if (bf == NULL) return NULL;
+    /* Optimal standard filter, plus a little slack for the uneven load of blocked filters */
+    bits = -log(fpr) / (M_LN2 * M_LN2) * 1.1;
+    bf->k = (int)(bits / 1.1 * M_LN2 + 0.5);
+    if (bf->k < 1) bf->k = 1;
+    if (bf->k > 16) bf->k = 16;
+    bf->blocks = (long long)ceil(bits * n / BLOOM_BLOCK_BITS);
+    bf->bits_per_key = (double)bf->blocks * BLOOM_BLOCK_BITS / n;
+    bf->bits = calloc(bf->blocks * (BLOOM_BLOCK_BITS / 64), sizeof(unsigned long long));
+    if (bf->bits == NULL) {
+        free(bf);
+        return NULL;
+    }
+    return bf;
+}
+
+void bloom_free(BLOOM *bf) {
+    if (bf == NULL) return;
+    free(bf->bits);
+    free(bf);
+}
+
+double bloom_expected_fpr(const BLOOM *bf, long long n) {
+    /* Average the standard formula over the Poisson-distributed number of keys per block */
+    double lambda = (double)n / bf->blocks, p = exp(-lambda), fpr = 0;
+    int i;
+    for (i = 0; i < 10 * lambda + 50; i++) {
+        fpr += p * pow(1 - pow(1 - 1.0 / BLOOM_BLOCK_BITS, (double)bf->k * i), bf->k);
+        p *= lambda / (i + 1);
+    }
+    return fpr;
+}
@@ -0,0 +1,68 @@
+//  Blocked Bloom filter used by cooccur to reject out-of-vocabulary tokens
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef _BLOOM_H_
+#define _BLOOM_H_
+
+#define BLOOM_BLOCK_BITS 512 // one cache line per key
+
+typedef struct bloom_filter {
+    unsigned long long *bits;
+    long long blocks;
+    int k;                 // bits set per key
+    double bits_per_key;
+} BLOOM;
+
+/* Size a filter for n keys and the target false-positive rate fpr */
+BLOOM *bloom_create(long long n, double fpr);
+void bloom_free(BLOOM *bf);
+
+/* Estimated false-positive rate once n keys are inserted */
+double bloom_expected_fpr(const BLOOM *bf, long long n);
+
+/* Block of a key, picked by multiply-shift so the block count need not be a power of two */
+static inline unsigned long long *bloom_block(const BLOOM *bf, unsigned long long h) {
+    return bf->bits + (((h >> 32) * (unsigned long long)bf->blocks) >> 32) * (BLOOM_BLOCK_BITS / 64);
+}
+
+/* Both take the 64-bit hash of the key (vocabhash_hash), so the hash is computed only once per token */
+static inline unsigned long long bloom_remix(unsigned long long h) {
+    h ^= h >> 31;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+static inline void bloom_add(BLOOM *bf, unsigned long long h) {
+    unsigned long long *block = bloom_block(bf, h), g = h;
+    int i;
+    for (i = 0; i < bf->k; i++) {
+        if (i % 7 == 0) g = bloom_remix(g + i);
+        block[(g & 511) >> 6] |= 1ULL << (g & 63);
+        g >>= 9;
+    }
+}
+
+static inline int bloom_maybe_contains(const BLOOM *bf, unsigned long long h) {
+    const unsigned long long *block = bloom_block(bf, h);
+    unsigned long long g = h;
+    int i;
+    for (i = 0; i < bf->k; i++) {
+        if (i % 7 == 0) g = bloom_remix(g + i);
+        if (!(block[(g & 511) >> 6] & (1ULL << (g & 63)))) return 0;
+        g >>= 9;
+    }
+    return 1;
+}
+
+#endif
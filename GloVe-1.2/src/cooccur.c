@@ -28,12 +28,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "tokenizer.h"
+#include "vocab_hash.h"
+#include "id_map.h"
+#include "bloom.h"
+#include "hugepage.h"
+#include "spill_run.h"
+#include "pair_map.h"
 
-#define TSIZE 1048576
-#define SEED 1159241
-#define HASHFN bitwisehash
-
-static const int MAX_STRING_LENGTH = 1000;
 typedef double real;
 
 typedef struct cooccur_rec {
@@ -42,6 +47,12 @@ typedef struct cooccur_rec {
     real val;
 } CREC;
 
+typedef struct cooccur_rec_int {
+    int word1;
+    int word2;
+    unsigned int val;
+} CRECI; // 12-byte record used with -int-counts
+
 typedef struct cooccur_rec_id {
     int word1;
     int word2;
@@ -49,20 +60,59 @@ typedef struct cooccur_rec_id {
     int id;
 } CRECID;
 
-typedef struct hashrec {
-    char	*word;
-    long long id;
-    struct hashrec *next;
-} HASHREC;
-
 int verbose = 2; // 0, 1, or 2
 long long max_product; // Cutoff for product of word frequency ranks below which cooccurrence counts will be stored in a compressed full array
 long long overflow_length; // Number of cooccurrence records whose product exceeds max_product to store in memory before writing to disk
 int window_size = 15; // default context window size
 int symmetric = 1; // 0: asymmetric, 1: symmetric
+int triangular = 0; // 1: with symmetric, store each unordered pair once (word1 <= word2) and expand to both orientations on output
 real memory_limit = 3; // soft limit, in gigabytes, used to estimate optimal array sizes
-char *vocab_file, *file_head;
+char *vocab_file, *file_head; // file_head includes the -temp-dir prefix
 int noseq = 0;
+int int_counts = 0; // 1: 32-bit counters in the dense table and 12-byte records in temp files and output; requires noseq
+real bloom_fpr = 0; // target false-positive rate of the out-of-vocabulary filter, 0 to disable
+int block_accumulate = 0; // 1: stage dense-table updates per table block and apply them block by block
+int hugepages = HUGEPAGE_THP; // page size for the dense table and overflow buffer: 0 regular, 1 transparent huge pages, 2 explicit huge pages
+int num_threads = 0; // threads used to pre-fault the dense table and aggregate partitions, 0 for one per online CPU
+int spill_buffers = 2; // overflow buffers; with more than one, full buffers are sorted and written by a background thread while counting goes on
+int num_partitions = 0; // >0: route overflow records into that many word1-range partitions aggregated in memory, instead of the k-way merge
+int *partition_of; // partition of each word1 rank, with -partitions
+FILE **partition_files;
+long long *partition_records; // records written to each partition
+int topk = 0; // >0: write only the topk largest counts of each word1, ties going to the smaller word2
+real min_pair_count = 0; // pairs with a smaller count are not written
+int session = 0; // 1: each line is a session, count every unordered pair of its distinct words once, regardless of distance
+long long session_cap = 1000; // sessions with more distinct words are down-sampled to this many
+int num_configs = 0; // >0: count one table per -configs entry in the same pass
+int *config_window, *config_symmetric; // window size and direction of each -configs entry
+char *config_output; // -configs: the table of entry <window><s|a> goes to <config_output>_<window><s|a>.bin
+int segments = 0; // 1: the first token of each line is a segment key and every segment gets its own table
+char *segment_output; // -segments: the table of the n-th segment of the vocab file (from 0) goes to <segment_output>_<n>.bin
+VOCABHASH *segment_hash; // segment keys, in vocab file order
+long long *segment_offset; // segment s has the word indices segment_offset[s] + 1 .. segment_offset[s + 1]
+char *segment_opened; // the table of the segment has been created
+int segment_current = -1; // segment of segment_fout
+FILE *segment_fout;
+int segment_error;
+PAIRMAP *segment_ranks; // (segment + 1, word + 1) -> word index of the word in that segment
+int segment_local = 0; // -segments without -source-prefix: each segment has a dense region of its own, indexed by ranks within it
+int max_product_given = 0; // -max-product was given; otherwise -segments refits the -memory heuristic to the segment regions
+char *source_prefix, *target_prefix; // both set: count only the pairs of a source and a target item, in rows of the sources
+int bipartite = 0;
+long long *side_rank; // signed rank of each word index: source rank > 0, -(target rank) < 0, 0 if on neither side
+int *source_word, *target_word; // word index of each source and target rank
+long long num_sources, num_targets, side_cap;
+long long segment_cap; // allocated segment_offset entries
+real subsample = 0; // >0: word2vec-style threshold t, a token of a word with frequency f is kept with probability sqrt(t/f) + t/f
+real *keep_rate; // -subsample: keep probability of each word index
+unsigned long long subsample_rng = 2463534242ULL; // Fixed seed, so every run drops the same tokens
+int weighted = 0; // 1: the first token of each line is its multiplicity, as written by dedup
+long long line_weight = 1; // multiplicity of the current line, every pair of it counts that many times
+#define MAX_LINE_WEIGHT 4294967295LL // -weighted: the largest multiplicity, the range of the -int-counts counters
+int int_tokens = 0; // 1: words are numeric ids, looked up in id_map by value instead of in the string table
+IDMAP *id_map; // -int-tokens: vocab ids to insertion index
+int auto_plan = 0; // 1: choose max_product and overflow_length from a sample of the corpus instead of the -memory heuristic
+long long plan_sample = 2000000; // tokens sampled by -auto-plan
 
 /* Efficient string comparison */
 int scmp( char *s1, char *s2 ) {
@@ -70,93 +120,191 @@ int scmp( char *s1, char *s2 ) {
     return(*s1 - *s2);
 }
 
-/* Move-to-front hashing and hash function from Hugh Williams, http://www.seg.rmit.edu.au/code/zwh-ipl/ */
-
-/* Simple bitwise hash function */
-unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
-    char c;
-    unsigned int h;
-    h = seed;
-    for(; (c =* word) != '\0'; word++) h ^= ((h << 5) + c + (h >> 2));
-    return((unsigned int)((h&0x7fffffff) % tsize));
-}
-
-/* Create hash table, initialise pointers to NULL */
-HASHREC ** inithashtable() {
-    int	i;
-    HASHREC **ht;
-    ht = (HASHREC **) malloc( sizeof(HASHREC *) * TSIZE );
-    for(i = 0; i < TSIZE; i++) ht[i] = (HASHREC *) NULL;
-    return(ht);
-}
-
-/* Search hash table for given string, return record if found, else NULL */
-HASHREC *hashsearch(HASHREC **ht, char *w) {
-    HASHREC	*htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    for(hprv = NULL, htmp=ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if( htmp != NULL && hprv!=NULL ) { // move to front on access
-        hprv->next = htmp->next;
-        htmp->next = ht[hval];
-        ht[hval] = htmp;
-    }
-    return(htmp);
-}
-
-/* Insert string in hash table, check for duplicates which should be absent */
-void hashinsert(HASHREC **ht, char *w, long long id) {
-    HASHREC	*htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    for(hprv = NULL, htmp = ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if(htmp == NULL) {
-        htmp = (HASHREC *) malloc(sizeof(HASHREC));
-        htmp->word = (char *) malloc(strlen(w) + 1);
-        strcpy(htmp->word, w);
-        htmp->id = id;
-        htmp->next = NULL;
-        if(hprv == NULL) ht[hval] = htmp;
-        else hprv->next = htmp;
-    }
-    else fprintf(stderr, "Error, duplicate entry located: %s.\n",htmp->word);
-    return;
-}
-
-/* Read word from input stream */
-int get_word(char *word, FILE *fin) {
-    int i = 0, ch;
-    while(!feof(fin)) {
-        ch = fgetc(fin);
-        if(ch == 13) continue;
-        if((ch == ' ') || (ch == '\t') || (ch == '\n')) {
-            if(i > 0) {
-                if (ch == '\n') ungetc(ch, fin);
-                break;
-            }
-            if (ch == '\n') return 1;
-            else continue;
-        }
-        word[i++] = ch;
-        if(i >= MAX_STRING_LENGTH - 1) i--;   // truncate words that exceed max length
+/* Append a record of a sorted chunk to its run: the temp file fout, or with fout NULL (-partitions) the file of the
+ * partition of word1, switching *w to a new run whenever the partition changes; returns 1 on a write error */
+int chunk_put(RUNWRITER **w, FILE *fout, int *part, int word1, int word2, real val) {
+    if(fout == NULL && partition_of[word1] != *part) {
+        if(*w != NULL && run_writer_close(*w)) return 1;
+        *part = partition_of[word1];
+        if((*w = run_writer_open(partition_files[*part], int_counts)) == NULL) return 1;
     }
-    word[i] = 0;
-    return 0;
+    if(fout == NULL) partition_records[*part]++;
+    return run_write(*w, word1, word2, val);
 }
 
-/* Write sorted chunk of cooccurrence records to file, accumulating duplicate entries */
+/* Write sorted chunk of cooccurrence records to file as an encoded run, accumulating duplicate entries; returns 1 on a write error.
+ * With fout NULL the records are distributed over the partitions instead. */
 int write_chunk(CREC *cr, long long length, FILE *fout) {
     long long a = 0;
     CREC old = cr[a];
+    RUNWRITER *w = NULL;
+    int err = 0, part = -1;
     
+    if(length == 0) return 0;
+    if(fout != NULL && (w = run_writer_open(fout, 0)) == NULL) return 1;
     for(a = 1; a < length; a++) {
         if(cr[a].word1 == old.word1 && cr[a].word2 == old.word2) {
             old.val += cr[a].val;
             continue;
         }
-        fwrite(&old, sizeof(CREC), 1, fout);
+        err |= chunk_put(&w, fout, &part, old.word1, old.word2, old.val);
         old = cr[a];
     }
-    fwrite(&old, sizeof(CREC), 1, fout);
-    return 0;
+    err |= chunk_put(&w, fout, &part, old.word1, old.word2, old.val);
+    return (w != NULL && run_writer_close(w)) | err;
+}
+
+/* Add w to an -int-counts counter, saturating at 2^32 - 1 as write_rec does rather than wrapping */
+static inline void count_add(unsigned int *count, unsigned int w) {
+    *count = *count > 0xffffffffu - w ? 0xffffffffu : *count + w;
+}
+
+/* Write sorted chunk of integer cooccurrence records to file as an encoded run, accumulating duplicate entries */
+int write_chunk_int(CRECI *cr, long long length, FILE *fout) {
+    long long a = 0;
+    CRECI old = cr[a];
+    RUNWRITER *w = NULL;
+    int err = 0, part = -1;
+    
+    if(length == 0) return 0;
+    if(fout != NULL && (w = run_writer_open(fout, 1)) == NULL) return 1;
+    for(a = 1; a < length; a++) {
+        if(cr[a].word1 == old.word1 && cr[a].word2 == old.word2) {
+            count_add(&old.val, cr[a].val);
+            continue;
+        }
+        err |= chunk_put(&w, fout, &part, old.word1, old.word2, old.val);
+        old = cr[a];
+    }
+    err |= chunk_put(&w, fout, &part, old.word1, old.word2, old.val);
+    return (w != NULL && run_writer_close(w)) | err;
+}
+
+/* -segments: switch segment_fout to the table of the segment of word index word1 and return that segment; tables are
+ * named by segment number, as keys come from the corpus and may not be valid file names */
+int segment_of(int word1) {
+    char filename[MAX_STRING_LENGTH + 20];
+    int lo = 0, hi = segment_hash->size - 1, mid;
+    if(segment_current >= 0 && word1 > segment_offset[segment_current] && word1 <= segment_offset[segment_current + 1]) return segment_current;
+    while(lo < hi) { // Last segment starting below word1
+        mid = (lo + hi + 1) / 2;
+        if(segment_offset[mid] < word1) lo = mid;
+        else hi = mid - 1;
+    }
+    if(segment_fout != NULL && fclose(segment_fout) != 0) segment_error = 1;
+    sprintf(filename,"%s_%d.bin",segment_output,lo);
+    if((segment_fout = fopen(filename, segment_opened[lo] ? "ab" : "wb")) == NULL) {
+        fprintf(stderr, "Unable to write file %s.\n",filename);
+        exit(1);
+    }
+    segment_opened[lo] = 1;
+    return segment_current = lo;
+}
+
+/* Write one record in the format selected by -int-counts; with -segments, to the table of its segment in segment-local ranks */
+void write_rec(int word1, int word2, real val, FILE *fout) {
+    if(bipartite) { // Source and target ranks back to word indices, which keeps the order
+        word1 = source_word[word1];
+        word2 = target_word[word2];
+    }
+    if(segments) {
+        int s = segment_of(word1);
+        fout = segment_fout;
+        word1 -= segment_offset[s];
+        word2 -= segment_offset[s];
+    }
+    if(int_counts) {
+        CRECI c;
+        c.word1 = word1;
+        c.word2 = word2;
+        c.val = (val >= 4294967295.0) ? 0xffffffffu : (unsigned int)(val + 0.5); // saturate rather than wrap; -subsample corrected counts are rounded
+        fwrite(&c, sizeof(CRECI), 1, fout);
+    }
+    else {
+        CREC c;
+        c.word1 = word1;
+        c.word2 = word2;
+        c.val = val;
+        fwrite(&c, sizeof(CREC), 1, fout);
+    }
+}
+
+/* Top-K selection of the current output row: a heap of at most topk records with the weakest at the top */
+CREC *row_heap;
+int row_size, row_word1;
+
+/* Record a is weaker than b: smaller count, or the same count and a larger word2 */
+static inline int weaker(const CREC *a, const CREC *b) {
+    return a->val < b->val || (a->val == b->val && a->word2 > b->word2);
+}
+
+void row_sift_down(int i) {
+    int j;
+    CREC t;
+    while((j = 2 * i + 1) < row_size) {
+        if(j + 1 < row_size && weaker(&row_heap[j + 1], &row_heap[j])) j++;
+        if(!weaker(&row_heap[j], &row_heap[i])) break;
+        t = row_heap[i]; row_heap[i] = row_heap[j]; row_heap[j] = t;
+        i = j;
+    }
+}
+
+int compare_word2(const void *a, const void *b) {
+    return ((CREC *) a)->word2 - ((CREC *) b)->word2;
+}
+
+/* Write the selected records of the current row in word2 order and start an empty one */
+void flush_row(FILE *fout) {
+    int i;
+    qsort(row_heap, row_size, sizeof(CREC), compare_word2);
+    for(i = 0; i < row_size; i++) write_rec(row_heap[i].word1, row_heap[i].word2, row_heap[i].val, fout);
+    row_size = 0;
+}
+
+/* Write one output record, subject to -min-pair-count and -topk; records arrive in (word1, word2) order */
+void emit_rec(int word1, int word2, real val, FILE *fout) {
+    CREC rec;
+    int i;
+    if(val < min_pair_count) return;
+    if(topk <= 0) {
+        write_rec(word1, word2, val, fout);
+        return;
+    }
+    if(word1 != row_word1) {
+        flush_row(fout);
+        row_word1 = word1;
+    }
+    rec.word1 = word1;
+    rec.word2 = word2;
+    rec.val = val;
+    if(row_size < topk) { // Sift up
+        for(i = row_size++; i > 0 && weaker(&rec, &row_heap[(i - 1) / 2]); i = (i - 1) / 2) row_heap[i] = row_heap[(i - 1) / 2];
+        row_heap[i] = rec;
+    }
+    else if(weaker(&row_heap[0], &rec)) {
+        row_heap[0] = rec;
+        row_sift_down(0);
+    }
+}
+
+/* Write one final record; in triangular mode (word1 <= word2) stands for both orientations, and a diagonal pair,
+ * which the symmetric count would have incremented twice per occurrence, for twice its stored value */
+void write_pair(int word1, int word2, real val, FILE *fout) {
+    if(subsample > 0) { // Both tokens of a pair survive subsampling with the product of their keep rates
+        if(bipartite) val /= keep_rate[source_word[word1]] * keep_rate[target_word[word2]];
+        else val /= keep_rate[word1] * keep_rate[word2];
+    }
+    if(!triangular) emit_rec(word1, word2, val, fout);
+    else if(word1 == word2) emit_rec(word1, word2, 2 * val, fout);
+    else {
+        emit_rec(word1, word2, val, fout);
+        emit_rec(word2, word1, val, fout);
+    }
+}
+
+/* Read one record of a temp file, return 0 at end of file */
+static inline int read_rec(CRECID *rec, RUNREADER *fin) {
+    return run_read(fin, &rec->word1, &rec->word2, &rec->val);
 }
 
 /* Check if two cooccurrence records are for the same two words, used for qsort */
@@ -167,6 +315,13 @@ int compare_crec(const void *a, const void *b) {
     
 }
 
+/* Same as compare_crec, for integer records */
+int compare_creci(const void *a, const void *b) {
+    int c;
+    if( (c = ((CRECI *) a)->word1 - ((CRECI *) b)->word1) != 0) return c;
+    else return (((CRECI *) a)->word2 - ((CRECI *) b)->word2);
+}
+
 /* Check if two cooccurrence records are for the same two words */
 int compare_crecid(CRECID a, CRECID b) {
     int c;
@@ -219,196 +374,1319 @@ int merge_write(CRECID new, CRECID *old, FILE *fout) {
         old->val += new.val;
         return 0; // Indicates duplicate entry
     }
-    fwrite(old, sizeof(CREC), 1, fout);
+    write_pair(old->word1, old->word2, old->val, fout);
     *old = new;
     return 1; // Actually wrote to file
 }
 
-/* Merge [num] sorted files of cooccurrence records */
-int merge_files(int num) {
+/* Merge [num] sorted files of cooccurrence records named after head into fout */
+int merge_files(const char *head, int num, FILE *fout) {
     int i, size;
-    long long counter = 0;
+    long long counter = 0, records = 0, encoded_bytes = 0;
     CRECID *pq, new, old;
-    char filename[200];
-    FILE **fid, *fout;
-    fid = malloc(sizeof(FILE) * num);
+    char filename[MAX_STRING_LENGTH + 20];
+    FILE **files;
+    RUNREADER **fid;
+    files = malloc(sizeof(FILE *) * num);
+    fid = malloc(sizeof(RUNREADER *) * num);
     pq = malloc(sizeof(CRECID) * num);
-    fout = stdout;
+    if(files == NULL || fid == NULL || pq == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
     if(verbose > 1) fprintf(stderr, "Merging cooccurrence files: processed 0 lines.");
     
-    /* Open all files and add first entry of each to priority queue */
+    /* Open all files and add first entry of each to priority queue; files may be empty */
+    size = 0;
     for(i = 0; i < num; i++) {
-        sprintf(filename,"%s_%04d.bin",file_head,i);
-        fid[i] = fopen(filename,"rb");
-        if(fid[i] == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
-        fread(&new, sizeof(CREC), 1, fid[i]);
-        new.id = i;
-        insert(pq,new,i+1);
+        sprintf(filename,"%s_%04d.bin",head,i);
+        files[i] = fopen(filename,"rb");
+        if(files[i] == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
+        fseeko(files[i], 0, SEEK_END);
+        encoded_bytes += ftello(files[i]);
+        rewind(files[i]);
+        if((fid[i] = run_reader_open(files[i], int_counts)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        if(read_rec(&new, fid[i])) {
+            new.id = i;
+            insert(pq,new,++size);
+        }
     }
     
     /* Pop top node, save it in old to see if the next entry is a duplicate */
-    size = num;
-    old = pq[0];
-    i = pq[0].id;
-    delete(pq, size);
-    fread(&new, sizeof(CREC), 1, fid[i]);
-    if(feof(fid[i])) size--;
-    else {
-        new.id = i;
-        insert(pq, new, size);
+    old.word1 = 0;
+    if(size > 0) {
+        old = pq[0];
+        i = pq[0].id;
+        delete(pq, size);
+        if(!read_rec(&new, fid[i])) size--;
+        else {
+            new.id = i;
+            insert(pq, new, size);
+        }
     }
     
     /* Repeatedly pop top node and fill priority queue until files have reached EOF */
     while(size > 0) {
+        records++;
         counter += merge_write(pq[0], &old, fout); // Only count the lines written to file, not duplicates
         if((counter%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[39G%lld lines.",counter);
         i = pq[0].id;
         delete(pq, size);
-        fread(&new, sizeof(CREC), 1, fid[i]);
-        if(feof(fid[i])) size--;
+        if(!read_rec(&new, fid[i])) size--;
         else {
             new.id = i;
             insert(pq, new, size);
         }
     }
-    fwrite(&old, sizeof(CREC), 1, fout);
-    fprintf(stderr,"\033[0GMerging cooccurrence files: processed %lld lines.\n",++counter);
+    if(old.word1 > 0) { // Nothing was popped if every file was empty
+        write_pair(old.word1, old.word2, old.val, fout);
+        counter++;
+    }
+    flush_row(fout);
+    fprintf(stderr,"\033[0GMerging cooccurrence files: processed %lld lines.\n",counter);
+    if(verbose > 1 && records > 0) fprintf(stderr, "temp files: %.1f MB encoded, %.1f MB as raw records\n",
+            encoded_bytes / 1048576.0, (records + 1) * (real)(int_counts ? sizeof(CRECI) : sizeof(CREC)) / 1048576.0);
     for(i=0;i<num;i++) {
-        sprintf(filename,"%s_%04d.bin",file_head,i);
+        run_reader_close(fid[i]);
+        fclose(files[i]);
+        sprintf(filename,"%s_%04d.bin",head,i);
         remove(filename);
     }
     fprintf(stderr,"\n");
+    free(files);
+    free(fid);
+    free(pq);
+    return 0;
+}
+
+/* The preceding in-vocabulary words of the current line, shared by all counters and sized for the largest window */
+typedef struct history {
+    long long *words;           // circular buffer
+    long long pos;              // slot that receives the next word
+    long long len;              // number of slots
+} HISTORY;
+
+/* Counting state of one table: dense table and overflow buffer */
+typedef struct cooccur_counter {
+    int window;                 // context words to the left (and right, if symmetric)
+    int symmetric;
+    char head[MAX_STRING_LENGTH + 20]; // temp file prefix
+    long long *lookup;          // row offsets into the dense table, shared by all counters; with segment_local, from the current segment's rows
+    long long word_base;        // segment_local: word index of rank 0 of the current segment, added back to overflow records
+    real *bigram_table;         // dense table, weighted counts
+    unsigned int *bigram_count; // dense table of -int-counts
+    CREC *cr;                   // overflow buffer
+    CRECI *cri;                 // overflow buffer of -int-counts
+    long long ind;              // number of records in the overflow buffer
+    long long spill_at;         // spill the overflow buffer once ind reaches this
+    real *inv_dist;             // inv_dist[d] = 1/d, distance weights without a division
+    int fidcounter;             // number of the temp file that receives the current overflow buffer
+    struct spiller *spill;      // sorts and writes full overflow buffers
+    unsigned long long *stage;  // -block-accumulate: pending dense updates, (index << 8 | distance), stage_len per block
+    int *stage_fill;            // number of pending updates of each block
+    int stage_shift;            // log2 of the number of table elements per block
+    int stage_len;
+    long long stage_blocks;
+    long long *session;         // -session: distinct words of the current line
+    long long session_len;
+    long long *session_seen;    // session_seen[w] == session_id once w is in the current session
+    long long session_id;
+    long long sessions, sessions_capped;
+    unsigned long long rng;     // xorshift state for sampling capped sessions
+} COUNTER;
+
+#define STAGE_LEN 512           // pending updates per block before it is applied
+#define STAGE_MAX_BLOCKS 4096   // bounds the number of buffers written to concurrently
+#define STAGE_MIN_SHIFT 15      // blocks of at least 32K elements
+
+/* Apply the pending updates of block p; they all fall into one cache-sized slice of the table */
+void flush_stage(COUNTER *c, long long p) {
+    unsigned long long *buf = c->stage + p * c->stage_len;
+    int i, n = c->stage_fill[p];
+    if(int_counts) for(i = 0; i < n; i++) count_add(&c->bigram_count[buf[i] >> 8], 1);
+    else if(noseq) for(i = 0; i < n; i++) c->bigram_table[buf[i] >> 8] += 1.0;
+    else for(i = 0; i < n; i++) c->bigram_table[buf[i] >> 8] += c->inv_dist[buf[i] & 255];
+    c->stage_fill[p] = 0;
+}
+
+/* Queue an update of dense element idx at distance d instead of scattering it into the table right away; d is only
+ * read back for distance-weighted windows, which main() keeps within 8 bits, so wider -noseq windows keep its low bits */
+static inline void stage_update(COUNTER *c, long long idx, long long d) {
+    long long p = idx >> c->stage_shift;
+    c->stage[p * c->stage_len + c->stage_fill[p]] = ((unsigned long long)idx << 8) | (d & 255);
+    if(++c->stage_fill[p] == c->stage_len) flush_stage(c, p);
+}
+
+/* Set up staging buffers for a dense table of n elements, return 1 if out of memory */
+int init_stage(COUNTER *c, long long n) {
+    c->stage_shift = STAGE_MIN_SHIFT;
+    while((n >> c->stage_shift) >= STAGE_MAX_BLOCKS) c->stage_shift++;
+    c->stage_blocks = (n >> c->stage_shift) + 1;
+    c->stage_len = STAGE_LEN;
+    c->stage = malloc(sizeof(unsigned long long) * c->stage_blocks * c->stage_len);
+    c->stage_fill = calloc(c->stage_blocks, sizeof(int));
+    return c->stage == NULL || c->stage_fill == NULL;
+}
+
+/* Count the pairs of target word w2 (the j-th in-vocab word of its line) with its left context in hist, where 0 marks a dropped token.
+ * Generated once per (window size, weighting, symmetry, counter type) so the inner loop has no mode branches;
+ * WIN is 0 for a window size only known at run time. */
+typedef void (*COUNT_KERNEL)(COUNTER *c, const HISTORY *hist, long long w2, long long j);
+
+#define DEFINE_COUNT_KERNEL(NAME, WIN, NOSEQ, SYM, INT, BLK, TRI) \
+static void NAME(COUNTER *c, const HISTORY *hist, long long w2, long long j) { \
+    const long long window = (WIN) ? (WIN) : c->window; \
+    const long long limit = max_product / w2; /* w1 * w2 < max_product, hoisted out of the loop */ \
+    const long long *lookup = c->lookup; \
+    const long long base = c->word_base; \
+    const long long *history = hist->words; \
+    const real wt = (real)line_weight; \
+    const unsigned int wi = (unsigned int)line_weight; \
+    long long n = j < window ? j : window, slot = hist->pos, d, w1, lo, hi, ind = c->ind; \
+    for(d = 1; d <= n; d++) { /* Iterate over the words to the left of the target word, nearest first */ \
+        slot = (slot == 0 ? hist->len : slot) - 1; \
+        w1 = history[slot]; \
+        if(w1 == 0) continue; /* Token dropped by -subsample */ \
+        if(TRI) { /* One update of the unordered pair (lo, hi) stands for both orientations */ \
+            lo = w1 < w2 ? w1 : w2; \
+            hi = w1 < w2 ? w2 : w1; \
+            if((lo + 1) * hi <= max_product) { \
+                if(BLK) stage_update(c, lookup[lo-1] + hi - lo, d); \
+                else if(INT) count_add(&c->bigram_count[lookup[lo-1] + hi - lo], wi); \
+                else c->bigram_table[lookup[lo-1] + hi - lo] += (NOSEQ) ? wt : wt * c->inv_dist[d]; \
+            } \
+            else if(INT) { c->cri[ind].word1 = lo + base; c->cri[ind].word2 = hi + base; c->cri[ind].val = wi; ind++; } \
+            else { c->cr[ind].word1 = lo + base; c->cr[ind].word2 = hi + base; c->cr[ind].val = (NOSEQ) ? wt : wt * c->inv_dist[d]; ind++; } \
+        } \
+        else if(w1 < limit) { /* Product is small enough to store in a full array */ \
+            if(BLK) { \
+                stage_update(c, lookup[w1-1] + w2 - 2, d); \
+                if(SYM) stage_update(c, lookup[w2-1] + w1 - 2, d); \
+            } \
+            else if(INT) { \
+                count_add(&c->bigram_count[lookup[w1-1] + w2 - 2], wi); \
+                if(SYM) count_add(&c->bigram_count[lookup[w2-1] + w1 - 2], wi); \
+            } \
+            else { \
+                c->bigram_table[lookup[w1-1] + w2 - 2] += (NOSEQ) ? wt : wt * c->inv_dist[d]; \
+                if(SYM) c->bigram_table[lookup[w2-1] + w1 - 2] += (NOSEQ) ? wt : wt * c->inv_dist[d]; \
+            } \
+        } \
+        else { /* Product is too big, data is likely to be sparse; buffer the record to be sorted and spilled later */ \
+            if(INT) { \
+                c->cri[ind].word1 = w1 + base; c->cri[ind].word2 = w2 + base; c->cri[ind].val = wi; ind++; \
+                if(SYM) { c->cri[ind].word1 = w2 + base; c->cri[ind].word2 = w1 + base; c->cri[ind].val = wi; ind++; } \
+            } \
+            else { \
+                c->cr[ind].word1 = w1 + base; c->cr[ind].word2 = w2 + base; c->cr[ind].val = (NOSEQ) ? wt : wt * c->inv_dist[d]; ind++; \
+                if(SYM) { c->cr[ind].word1 = w2 + base; c->cr[ind].word2 = w1 + base; c->cr[ind].val = (NOSEQ) ? wt : wt * c->inv_dist[d]; ind++; } \
+            } \
+        } \
+    } \
+    c->ind = ind; \
+}
+
+/* The nine valid modes for one window size: distance-weighted or not, asymmetric, symmetric or triangular,
+ * integer counters (noseq only); the blocked variants stage dense updates (-block-accumulate), the counter type
+ * then only matters when a block is applied */
+#define DEFINE_COUNT_KERNELS_BLK(W, BLK, SUFFIX) \
+    DEFINE_COUNT_KERNEL(count_w##W##_dist_asym##SUFFIX, W, 0, 0, 0, BLK, 0) \
+    DEFINE_COUNT_KERNEL(count_w##W##_dist_sym##SUFFIX, W, 0, 1, 0, BLK, 0) \
+    DEFINE_COUNT_KERNEL(count_w##W##_noseq_asym##SUFFIX, W, 1, 0, 0, BLK, 0) \
+    DEFINE_COUNT_KERNEL(count_w##W##_noseq_sym##SUFFIX, W, 1, 1, 0, BLK, 0) \
+    DEFINE_COUNT_KERNEL(count_w##W##_int_asym##SUFFIX, W, 1, 0, 1, BLK, 0) \
+    DEFINE_COUNT_KERNEL(count_w##W##_int_sym##SUFFIX, W, 1, 1, 1, BLK, 0) \
+    DEFINE_COUNT_KERNEL(count_w##W##_dist_tri##SUFFIX, W, 0, 1, 0, BLK, 1) \
+    DEFINE_COUNT_KERNEL(count_w##W##_noseq_tri##SUFFIX, W, 1, 1, 0, BLK, 1) \
+    DEFINE_COUNT_KERNEL(count_w##W##_int_tri##SUFFIX, W, 1, 1, 1, BLK, 1)
+#define DEFINE_COUNT_KERNELS(W) \
+    DEFINE_COUNT_KERNELS_BLK(W, 0, ) \
+    DEFINE_COUNT_KERNELS_BLK(W, 1, _blk)
+#define COUNT_KERNEL_MODES(W, SUFFIX) \
+    {count_w##W##_dist_asym##SUFFIX, count_w##W##_dist_sym##SUFFIX, count_w##W##_noseq_asym##SUFFIX, count_w##W##_noseq_sym##SUFFIX, \
+     count_w##W##_int_asym##SUFFIX, count_w##W##_int_sym##SUFFIX, count_w##W##_dist_tri##SUFFIX, count_w##W##_noseq_tri##SUFFIX, count_w##W##_int_tri##SUFFIX}
+#define COUNT_KERNEL_ROW(W) {COUNT_KERNEL_MODES(W, ), COUNT_KERNEL_MODES(W, _blk)}
+
+DEFINE_COUNT_KERNELS(0)
+DEFINE_COUNT_KERNELS(5)
+DEFINE_COUNT_KERNELS(10)
+DEFINE_COUNT_KERNELS(15)
+
+/* Pick the kernel for a counter, once before counting */
+COUNT_KERNEL select_count_kernel(COUNTER *c) {
+    static const COUNT_KERNEL kernels[4][2][9] = {COUNT_KERNEL_ROW(0), COUNT_KERNEL_ROW(5), COUNT_KERNEL_ROW(10), COUNT_KERNEL_ROW(15)};
+    int w = (c->window == 5) ? 1 : (c->window == 10) ? 2 : (c->window == 15) ? 3 : 0;
+    int mode = triangular ? 6 + (int_counts ? 2 : noseq ? 1 : 0) : (int_counts ? 4 : noseq ? 2 : 0) + (c->symmetric > 0);
+    return kernels[w][block_accumulate > 0][mode];
+}
+
+/* Bipartite counting: only the pairs of a source and a target item, once per cooccurrence whichever comes first,
+ * into the row of the source. w2 and the history hold signed ranks (source rank > 0, -(target rank) < 0), the dense
+ * table has num_sources rows of at most num_targets columns, and there is no mode-specialized copy. */
+static void count_bipartite(COUNTER *c, const HISTORY *hist, long long w2, long long j) {
+    const long long *history = hist->words;
+    long long n = j < c->window ? j : c->window, slot = hist->pos, d, w1, a, b, idx, ind = c->ind;
+    for(d = 1; d <= n; d++) {
+        slot = (slot == 0 ? hist->len : slot) - 1;
+        w1 = history[slot];
+        if(w1 == 0 || (w1 > 0) == (w2 > 0)) continue; // Dropped by -subsample, or same side
+        a = w1 > 0 ? w1 : w2;
+        b = w1 > 0 ? -w2 : -w1;
+        if((a + 1) * b <= max_product) { // a < max_product / b, as for the square table
+            idx = c->lookup[a-1] + b - 2;
+            if(block_accumulate) stage_update(c, idx, d);
+            else if(int_counts) count_add(&c->bigram_count[idx], line_weight);
+            else c->bigram_table[idx] += noseq ? line_weight : line_weight * c->inv_dist[d];
+        }
+        else if(int_counts) { c->cri[ind].word1 = a; c->cri[ind].word2 = b; c->cri[ind].val = line_weight; ind++; }
+        else { c->cr[ind].word1 = a; c->cr[ind].word2 = b; c->cr[ind].val = noseq ? line_weight : line_weight * c->inv_dist[d]; ind++; }
+    }
+    c->ind = ind;
+}
+
+/* -source-prefix/-target-prefix: give word index index its signed rank on the side its prefix selects */
+int add_side_word(char *word, long long index) {
+    if(index >= side_cap) {
+        side_cap = side_cap ? 2 * side_cap : 1048576;
+        side_rank = realloc(side_rank, sizeof(long long) * side_cap);
+        source_word = realloc(source_word, sizeof(int) * side_cap);
+        target_word = realloc(target_word, sizeof(int) * side_cap);
+        if(side_rank == NULL || source_word == NULL || target_word == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    }
+    if(strncmp(word, source_prefix, strlen(source_prefix)) == 0) {
+        side_rank[index] = ++num_sources;
+        source_word[num_sources] = index;
+    }
+    else if(strncmp(word, target_prefix, strlen(target_prefix)) == 0) {
+        side_rank[index] = -(++num_targets);
+        target_word[num_targets] = index;
+    }
+    else side_rank[index] = 0;
+    return 0;
+}
+
+/* Overflow buffers on their way to disk. With more than one buffer a background thread sorts and writes each full
+ * buffer while counting continues in the next; counting only stalls when every buffer is waiting to be written. */
+typedef struct spill_job {
+    void *buf;                  // CREC or CRECI records
+    long long len;
+    int file;                   // temp file number
+    const char *head;           // temp file prefix
+} SPILL_JOB;
+
+typedef struct spiller {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int nbufs;
+    long long buffer_length;    // records per buffer
+    const char *head;           // temp file prefix
+    void **bufs;                // all buffers, for freeing
+    void **free_bufs;           // buffers ready to be filled
+    int nfree;
+    SPILL_JOB *queue;           // full buffers waiting for the writer, in file order
+    int qhead, qlen;
+    int done;                   // no more jobs will be queued
+    int error;                  // a temp file could not be written
+    long long stalls;           // times counting waited for a free buffer
+} SPILLER;
+
+/* Sort one full buffer and write it to its temp file, accumulating duplicates; returns 1 on failure */
+int write_spill(SPILL_JOB *job) {
+    char filename[MAX_STRING_LENGTH + 20];
+    FILE *fout;
+    int failed;
+    if(num_partitions > 0) fout = NULL; // Records go to the partition files
+    else {
+        sprintf(filename,"%s_%04d.bin",job->head,job->file);
+        fout = fopen(filename,"w");
+        if(fout == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
+    }
+    if(int_counts) {
+        qsort(job->buf, job->len, sizeof(CRECI), compare_creci);
+        failed = write_chunk_int((CRECI *)job->buf, job->len, fout);
+    }
+    else {
+        qsort(job->buf, job->len, sizeof(CREC), compare_crec);
+        failed = write_chunk((CREC *)job->buf, job->len, fout);
+    }
+    return (fout != NULL && fclose(fout) != 0) | failed;
+}
+
+void *spill_thread(void *arg) {
+    SPILLER *sp = (SPILLER *)arg;
+    SPILL_JOB job;
+    int failed;
+    pthread_mutex_lock(&sp->lock);
+    while(1) {
+        while(sp->qlen == 0 && !sp->done) pthread_cond_wait(&sp->changed, &sp->lock);
+        if(sp->qlen == 0) break;
+        job = sp->queue[sp->qhead];
+        pthread_mutex_unlock(&sp->lock);
+        failed = write_spill(&job);
+        pthread_mutex_lock(&sp->lock);
+        sp->qhead = (sp->qhead + 1) % sp->nbufs;
+        sp->qlen--;
+        sp->error |= failed;
+        sp->free_bufs[sp->nfree++] = job.buf;
+        pthread_cond_broadcast(&sp->changed);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return NULL;
+}
+
+/* Allocate nbufs overflow buffers sharing length records, for temp files named after head, and start the writer
+ * if there is more than one; NULL if out of memory */
+SPILLER *spiller_create(int nbufs, long long length, const char *head) {
+    SPILLER *sp = calloc(1, sizeof(SPILLER));
+    size_t rec = int_counts ? sizeof(CRECI) : sizeof(CREC);
+    int i;
+    if(sp == NULL) return NULL;
+    sp->nbufs = nbufs;
+    sp->buffer_length = length / nbufs;
+    sp->head = head;
+    sp->bufs = calloc(nbufs, sizeof(void *));
+    sp->free_bufs = calloc(nbufs, sizeof(void *));
+    sp->queue = calloc(nbufs, sizeof(SPILL_JOB));
+    if(sp->bufs == NULL || sp->free_bufs == NULL || sp->queue == NULL) return NULL;
+    /* The buffers are filled front to back, so they are left to fault in as they fill */
+    for(i = 0; i < nbufs; i++) {
+        if((sp->bufs[i] = huge_alloc(rec * (sp->buffer_length + 1), hugepages, 0, "overflow buffer", verbose > 1 && i == 0)) == NULL) return NULL;
+        sp->free_bufs[sp->nfree++] = sp->bufs[i];
+    }
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->changed, NULL);
+    if(nbufs > 1 && pthread_create(&sp->thread, NULL, spill_thread, sp) != 0) return NULL;
+    return sp;
+}
+
+/* Take a buffer to fill, waiting for the writer to release one if necessary */
+void *spiller_acquire(SPILLER *sp) {
+    void *buf;
+    pthread_mutex_lock(&sp->lock);
+    if(sp->nfree == 0) sp->stalls++;
+    while(sp->nfree == 0) pthread_cond_wait(&sp->changed, &sp->lock);
+    buf = sp->free_bufs[--sp->nfree];
+    pthread_mutex_unlock(&sp->lock);
+    return buf;
+}
+
+/* Hand a full buffer over to be written to temp file number file */
+void spiller_submit(SPILLER *sp, void *buf, long long len, int file) {
+    SPILL_JOB job;
+    job.buf = buf;
+    job.len = len;
+    job.file = file;
+    job.head = sp->head;
+    if(sp->nbufs == 1) { // No writer thread, write in place
+        sp->error |= write_spill(&job);
+        sp->free_bufs[sp->nfree++] = buf;
+        return;
+    }
+    pthread_mutex_lock(&sp->lock);
+    sp->queue[(sp->qhead + sp->qlen) % sp->nbufs] = job;
+    sp->qlen++;
+    pthread_cond_broadcast(&sp->changed);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+/* Wait for all queued buffers to be written and release the buffers; returns 1 if any temp file failed */
+int spiller_finish(SPILLER *sp) {
+    int i, error;
+    size_t rec = int_counts ? sizeof(CRECI) : sizeof(CREC);
+    if(sp->nbufs > 1) {
+        pthread_mutex_lock(&sp->lock);
+        sp->done = 1;
+        pthread_cond_broadcast(&sp->changed);
+        pthread_mutex_unlock(&sp->lock);
+        pthread_join(sp->thread, NULL);
+    }
+    if(verbose > 1 && sp->nbufs > 1) fprintf(stderr, "overflow spills: counting waited for a free buffer %lld times\n", sp->stalls);
+    for(i = 0; i < sp->nbufs; i++) huge_free(sp->bufs[i], rec * (sp->buffer_length + 1));
+    error = sp->error;
+    pthread_mutex_destroy(&sp->lock);
+    pthread_cond_destroy(&sp->changed);
+    free(sp->bufs);
+    free(sp->free_bufs);
+    free(sp->queue);
+    free(sp);
+    return error;
+}
+
+/* Point the counter at a fresh overflow buffer */
+void take_overflow_buffer(COUNTER *c) {
+    void *buf = spiller_acquire(c->spill);
+    if(int_counts) c->cri = (CRECI *)buf;
+    else c->cr = (CREC *)buf;
+    c->ind = 0;
+}
+
+/* Queue the overflow buffer for sorting and writing to the current temp file and continue in a fresh one */
+void spill_overflow(COUNTER *c) {
+    spiller_submit(c->spill, int_counts ? (void *)c->cri : (void *)c->cr, c->ind, c->fidcounter);
+    c->fidcounter++;
+    take_overflow_buffer(c);
+}
+
+int compare_rank(const void *a, const void *b) {
+    long long c = *(const long long *)a - *(const long long *)b;
+    return (c > 0) - (c < 0);
+}
+
+/* Add the weight of the session to dense element idx of a session pair */
+static inline void session_dense(COUNTER *c, long long idx) {
+    if(block_accumulate) stage_update(c, idx, 1);
+    else if(int_counts) count_add(&c->bigram_count[idx], line_weight);
+    else c->bigram_table[idx] += line_weight;
+}
+
+/* Buffer a session pair that is not in the dense table */
+static inline void session_overflow(COUNTER *c, long long word1, long long word2) {
+    word1 += c->word_base;
+    word2 += c->word_base;
+    if(int_counts) {c->cri[c->ind].word1 = word1; c->cri[c->ind].word2 = word2; c->cri[c->ind].val = line_weight;}
+    else {c->cr[c->ind].word1 = word1; c->cr[c->ind].word2 = word2; c->cr[c->ind].val = line_weight;}
+    c->ind++;
+}
+
+/* Add word w to the current session unless it is already there */
+static inline void session_add(COUNTER *c, long long w) {
+    if(c->session_seen[w] == c->session_id) return;
+    c->session_seen[w] = c->session_id;
+    c->session[c->session_len++] = w;
+}
+
+/* Count every unordered pair of distinct words of the finished session once and start the next one.
+ * Sorting the words lets row lo walk its partners hi in increasing rank: the dense ones come first, so the
+ * triangular row splits at a single cut. Sessions above session_cap words keep a uniform sample of session_cap. */
+void count_session(COUNTER *c) {
+    long long *s = c->session, n = c->session_len, i, j, k, t, lo, hi, cut, limit, row;
+    c->session_len = 0;
+    c->session_id++;
+    if(n == 0) return;
+    c->sessions++;
+    if(n > session_cap) {
+        for(i = 0; i < session_cap; i++) { // Partial Fisher-Yates shuffle, the sample ends up in s[0 .. session_cap - 1]
+            c->rng ^= c->rng << 13; c->rng ^= c->rng >> 7; c->rng ^= c->rng << 17;
+            k = i + (long long)(c->rng % (unsigned long long)(n - i));
+            t = s[i]; s[i] = s[k]; s[k] = t;
+        }
+        n = session_cap;
+        c->sessions_capped++;
+    }
+    if(bipartite) { // Every source with every target; sources and targets sort apart by the sign of their ranks
+        for(i = 0; i < n; i++) s[i] = side_rank[s[i]];
+        qsort(s, n, sizeof(long long), compare_rank);
+        for(k = 0; k < n && s[k] < 0; k++); // s[0 .. k-1] targets, s[k .. n-1] sources
+        for(i = k; i < n; i++) {
+            if(c->ind + k > c->spill->buffer_length) spill_overflow(c); // Room for the whole row
+            lo = s[i];
+            for(j = 0; j < k; j++) {
+                hi = -s[j];
+                if((lo + 1) * hi <= max_product) session_dense(c, c->lookup[lo-1] + hi - 2);
+                else session_overflow(c, lo, hi);
+            }
+        }
+        return;
+    }
+    qsort(s, n, sizeof(long long), compare_rank);
+    for(i = 0; i + 1 < n; i++) {
+        if(c->ind + 2 * (n - 1 - i) > c->spill->buffer_length) spill_overflow(c); // Room for the whole row
+        lo = s[i];
+        if(triangular) { /* (lo, hi) is dense while (lo + 1) * hi <= max_product */
+            row = c->lookup[lo-1] - lo;
+            for(cut = i + 1; cut < n && (lo + 1) * s[cut] <= max_product; cut++) session_dense(c, row + s[cut]);
+            for(j = cut; j < n; j++) session_overflow(c, lo, s[j]);
+        }
+        else { /* Both orientations; (lo, hi) is dense while lo < max_product / hi, (hi, lo) while hi < max_product / lo */
+            limit = max_product / lo;
+            for(j = i + 1; j < n; j++) {
+                hi = s[j];
+                if((lo + 1) * hi <= max_product) session_dense(c, c->lookup[lo-1] + hi - 2);
+                else session_overflow(c, lo, hi);
+                if(hi < limit) session_dense(c, c->lookup[hi-1] + lo - 2);
+                else session_overflow(c, hi, lo);
+            }
+        }
+    }
+}
+
+/* Split word1 ranks 1..vocab_size into num_partitions ranges of about equal total frequency and create their files */
+int init_partitions(long long *counts, long long vocab_size) {
+    char filename[MAX_STRING_LENGTH + 20];
+    long long a, total = 0, acc = 0;
+    int p = 0;
+    partition_of = malloc(sizeof(int) * (vocab_size + 1));
+    partition_files = calloc(num_partitions, sizeof(FILE *));
+    partition_records = calloc(num_partitions, sizeof(long long));
+    if(partition_of == NULL || partition_files == NULL || partition_records == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    for(a = 0; a < vocab_size; a++) total += counts[a];
+    partition_of[0] = 0;
+    for(a = 1; a <= vocab_size; a++) {
+        partition_of[a] = p;
+        acc += counts[a-1];
+        if(p < num_partitions - 1 && acc * (real)num_partitions >= total * (real)(p + 1)) p++;
+    }
+    for(p = 0; p < num_partitions; p++) {
+        sprintf(filename,"%s_p%04d.bin",file_head,p);
+        if((partition_files[p] = fopen(filename,"w+b")) == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
+    }
+    return 0;
+}
+
+/* Partitions are aggregated by a pool of threads, each taking the next partition, but written out strictly in order */
+typedef struct partition_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t turn_changed;
+    int next;                   // next partition to aggregate
+    int turn;                   // next partition to write
+    int error;
+    long long lines;            // distinct pairs written
+    long long max_pairs;        // distinct pairs of the largest partition
+} PARTITION_POOL;
+
+/* Sum the records of partition p in a hash map and return it with its entries sorted; NULL on failure */
+PAIRMAP *aggregate_partition(int p) {
+    RUNREADER *r;
+    PAIRMAP *m = pairmap_create(partition_records[p] / 2);
+    int word1, word2;
+    real val;
+    if(m == NULL) return NULL;
+    rewind(partition_files[p]);
+    if((r = run_reader_open(partition_files[p], int_counts)) == NULL) {pairmap_free(m); return NULL;}
+    while(run_read(r, &word1, &word2, &val)) {
+        if(pairmap_add(m, word1, word2, val)) {
+            pairmap_free(m);
+            m = NULL;
+            break;
+        }
+    }
+    run_reader_close(r);
+    if(m != NULL) pairmap_sort(m);
+    return m;
+}
+
+void *partition_thread(void *arg) {
+    PARTITION_POOL *pool = (PARTITION_POOL *)arg;
+    PAIRMAP *m;
+    char filename[MAX_STRING_LENGTH + 20];
+    long long i;
+    int p;
+    while(1) {
+        pthread_mutex_lock(&pool->lock);
+        p = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if(p >= num_partitions) break;
+        m = aggregate_partition(p);
+        fclose(partition_files[p]);
+        sprintf(filename,"%s_p%04d.bin",file_head,p);
+        remove(filename);
+        
+        pthread_mutex_lock(&pool->lock);
+        while(pool->turn != p) pthread_cond_wait(&pool->turn_changed, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        if(m != NULL) for(i = 0; i < m->size; i++) write_pair(pairmap_word1(&m->slots[i]), pairmap_word2(&m->slots[i]), m->slots[i].val, stdout);
+        pthread_mutex_lock(&pool->lock);
+        if(m == NULL) pool->error = 1;
+        else {
+            pool->lines += m->size;
+            if(m->size > pool->max_pairs) pool->max_pairs = m->size;
+            if(verbose > 1) fprintf(stderr,"\033[0GAggregating partitions: processed %lld lines.",pool->lines);
+        }
+        pool->turn++;
+        pthread_cond_broadcast(&pool->turn_changed);
+        pthread_mutex_unlock(&pool->lock);
+        pairmap_free(m);
+    }
+    return NULL;
+}
+
+/* Aggregate each partition in memory and write them out in word1 order; the counterpart of merge_files for -partitions */
+int aggregate_partitions() {
+    PARTITION_POOL pool;
+    pthread_t *pt;
+    int t, threads = num_threads < num_partitions ? num_threads : num_partitions;
+    memset(&pool, 0, sizeof(PARTITION_POOL));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.turn_changed, NULL);
+    pt = malloc(sizeof(pthread_t) * threads);
+    if(pt == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    if(verbose > 1) fprintf(stderr, "Aggregating partitions: processed 0 lines.");
+    for(t = 0; t < threads; t++) pthread_create(&pt[t], NULL, partition_thread, &pool);
+    for(t = 0; t < threads; t++) pthread_join(pt[t], NULL);
+    flush_row(stdout);
+    fprintf(stderr,"\033[0GAggregating partitions: processed %lld lines.\n",pool.lines);
+    if(verbose > 1) fprintf(stderr, "%d partitions with %d threads, largest %lld pairs\n", num_partitions, threads, pool.max_pairs);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.turn_changed);
+    free(pt);
+    free(partition_of);
+    free(partition_files);
+    free(partition_records);
+    if(pool.error) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    return 0;
+}
+
+/* Intern a vocab file word: in the string table, or with -int-tokens 1 in the id map. Returns its insertion index, or -1 with an
+ * error message if out of memory or the word is not an id */
+long long intern_word(VOCABHASH *vocab_hash, char *word, int *inserted) {
+    unsigned long long id;
+    long long idx;
+    int len = strlen(word);
+    if(int_tokens && !idmap_parse(word, len, &id)) {fprintf(stderr, "Error, vocab word %s is not an id; use vocab_count -int-tokens 1.\n", word); return -1;}
+    idx = int_tokens ? idmap_insert(id_map, id, idmap_hash(id), inserted) : vocabhash_insert(vocab_hash, word, len, vocabhash_hash(word, len), inserted);
+    if(idx < 0) fprintf(stderr, "Couldn't allocate memory!");
+    return idx;
+}
+
+/* Insertion index of a corpus token, -1 if it is out of vocabulary */
+static inline long long find_word(VOCABHASH *vocab_hash, char *word, int len) {
+    unsigned long long id;
+    if(!int_tokens) return vocabhash_find(vocab_hash, word, len, vocabhash_hash(word, len));
+    return idmap_parse(word, len, &id) ? idmap_find(id_map, id, idmap_hash(id)) : -1;
+}
+
+/* -segments: give word of segment key the word index index; the vocab file lists the words of a segment in one block,
+ * so every segment owns a contiguous range of indices, ranked by the frequencies within the segment */
+int add_segment_word(VOCABHASH *vocab_hash, char *key, char *word, long long index) {
+    int len = strlen(key), inserted;
+    long long s = vocabhash_insert(segment_hash, key, len, vocabhash_hash(key, len), &inserted), w;
+    if(s < 0) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    if(inserted) { // The segment starts at this index
+        if(s + 2 > segment_cap) {
+            segment_cap = segment_cap ? 2 * segment_cap : 1024;
+            if((segment_offset = realloc(segment_offset, sizeof(long long) * segment_cap)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        }
+        segment_offset[s] = index - 1;
+    }
+    else if(s != segment_hash->size - 1) {fprintf(stderr, "Error, the words of segment %s are not contiguous.\n", key); return 1;}
+    segment_offset[s + 1] = index;
+    if((w = intern_word(vocab_hash, word, NULL)) < 0) return 1;
+    if(pairmap_find(segment_ranks, s + 1, w + 1) != NULL) {fprintf(stderr, "Error, duplicate entry located: %s %s.\n", key, word); return 1;}
+    if(pairmap_add(segment_ranks, s + 1, w + 1, index)) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
     return 0;
 }
 
-/* Collect word-word cooccurrence counts from input stream */
+/* -weighted: multiplicity token of a line, 0 if malformed so that the line counts nothing, -1 if above MAX_LINE_WEIGHT */
+long long parse_line_weight(const char *word) {
+    char *end;
+    long long w = strtoll(word, &end, 10);
+    if(*end != '\0' || w < 0) return 0;
+    return w > MAX_LINE_WEIGHT ? -1 : w;
+}
+
+/* -subsample: keep rate of every word index from its count, the frequency being relative to all words of its segment
+ * (the whole vocabulary without -segments); returns the number of words with a keep rate below 1, -1 if out of memory */
+long long init_keep_rates(long long *counts, long long vocab_size) {
+    long long a, s, n = 0, nseg = segments ? segment_hash->size : 1;
+    real total, f;
+    if((keep_rate = malloc(sizeof(real) * (vocab_size + 1))) == NULL) return -1;
+    keep_rate[0] = 1;
+    for(s = 0; s < nseg; s++) {
+        long long lo = segments ? segment_offset[s] : 0, hi = segments ? segment_offset[s + 1] : vocab_size;
+        for(a = lo, total = 0; a < hi; a++) total += counts[a];
+        for(a = lo; a < hi; a++) {
+            f = counts[a] / total;
+            keep_rate[a + 1] = (f > subsample) ? sqrt(subsample / f) + subsample / f : 1;
+            if(keep_rate[a + 1] < 1) n++;
+            else keep_rate[a + 1] = 1;
+        }
+    }
+    return n;
+}
+
+/* -subsample: whether to drop the current token of word index w, at random with probability 1 - keep_rate[w] */
+static inline int subsample_drop(long long w) {
+    if(keep_rate[w] >= 1) return 0;
+    subsample_rng ^= subsample_rng << 13;
+    subsample_rng ^= subsample_rng >> 7;
+    subsample_rng ^= subsample_rng << 17;
+    return (subsample_rng >> 11) * (1.0 / 9007199254740992.0) >= keep_rate[w];
+}
+
+#define PLAN_STEPS 4      // candidate max_product values per doubling
+#define PLAN_CHUNKS 16    // places of the corpus the plan samples from
+#define PLAN_MAX_RUNS 500 // temp files a plan may leave for the merge, below the usual limit on open files
+
+/* Dense elements of rows rows of at most cols columns for max_product p, as the lookup table in get_cooccurrence lays them out */
+long long dense_rows(long long p, long long rows, long long cols) {
+    long long a, b, n = 0;
+    if(triangular) for(a = 1; a <= rows; a++) {
+        b = p / (a + 1) < cols ? p / (a + 1) : cols;
+        if(b < a) break;
+        n += b - a + 1;
+    }
+    else for(a = 1; a <= rows && p / a > 0; a++) n += p / a < cols ? p / a : cols;
+    return n;
+}
+
+/* Dense elements of the table for max_product p; with segment_local the sum of the segments' regions */
+long long dense_size(long long p, long long rows, long long cols) {
+    long long s, n = 1;
+    if(!segment_local) return n + dense_rows(p, rows, cols);
+    for(s = 0; s < segment_hash->size; s++) n += dense_rows(p, segment_offset[s + 1] - segment_offset[s], segment_offset[s + 1] - segment_offset[s]);
+    return n;
+}
+
+/* -segments: the largest max_product whose segment regions together take no more elements than the one table of
+ * vocab_size rows the -memory heuristic sized; every segment then has the low ranks of its own region dense */
+long long segment_max_product(long long vocab_size) {
+    long long target = 1 + dense_rows(max_product, vocab_size, vocab_size), lo = 1, hi = 0, mid, s;
+    for(s = 0; s < segment_hash->size; s++) if(segment_offset[s + 1] - segment_offset[s] > hi) hi = segment_offset[s + 1] - segment_offset[s];
+    hi = (hi + 1) * hi; // Every region fully dense
+    while(lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        if(dense_size(mid, vocab_size, vocab_size) <= target) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* -auto-plan: a record goes to the dense table once max_product >= t; add its weight to the bin of the first candidate that takes it */
+static inline void plan_record(real *bins, const long long *grid, int ngrid, long long t, real w) {
+    int lo = 0, hi = ngrid, mid;
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(grid[mid] >= t) hi = mid;
+        else lo = mid + 1;
+    }
+    bins[lo] += w;
+}
+
+/* -auto-plan: bin the records the kernels of table k would produce for pair (w1, w2) of word indices, w1 first on the line;
+ * base is the word_base the kernels see them with */
+static inline void plan_pair(real *bins, const long long *grid, int ngrid, long long w1, long long w2, int sym, real w, long long base) {
+    long long a, b;
+    if(subsample > 0) w *= keep_rate[w1] * keep_rate[w2];
+    w1 -= base;
+    w2 -= base;
+    if(bipartite) {
+        if((side_rank[w1] > 0) == (side_rank[w2] > 0)) return;
+        a = side_rank[w1] > 0 ? side_rank[w1] : side_rank[w2];
+        b = side_rank[w1] > 0 ? -side_rank[w2] : -side_rank[w1];
+        plan_record(bins, grid, ngrid, (a + 1) * b, w);
+    }
+    else if(triangular) plan_record(bins, grid, ngrid, ((w1 < w2 ? w1 : w2) + 1) * (w1 < w2 ? w2 : w1), w);
+    else {
+        plan_record(bins, grid, ngrid, (w1 + 1) * w2, w);
+        // the window kernels route both orientations by w1 < max_product / w2, sessions each one by its own product
+        if(sym) plan_record(bins, grid, ngrid, session ? (w2 + 1) * w1 : (w1 + 1) * w2, w);
+    }
+}
+
+/* -auto-plan: sample stdin at PLAN_CHUNKS places, estimate how many records each candidate max_product would spill, and set
+ * max_product and overflow_length to the smallest dense table whose spill is within 0.5% of the least that fits in -memory,
+ * with the rest of the memory, or as much as the estimated spill needs, for the overflow buffers. vocab_total, the sum of the vocab counts, scales the sample up to
+ * the corpus. Keeps the heuristic values if stdin cannot be rewound. Returns 1 if out of memory. */
+int plan_memory(VOCABHASH *vocab_hash, long long vocab_total, long long rows, long long cols) {
+    int fd = fileno(stdin), flag, len, ngrid = 0, i, k, best = -1, chunks, weight_next, key_next, ncounters = num_configs > 0 ? num_configs : 1;
+    long long grid[64 * PLAN_STEPS + 2], g, n, m, d, j, cap = 1024, tokens = 0, quota, line_tokens, seg = 0, w, stride, *s, full, min_ovf, base;
+    long long dense, ovf, runs, elem = int_counts ? sizeof(unsigned int) : sizeof(real), rec = int_counts ? sizeof(CRECI) : sizeof(CREC);
+    real *bins, *spill, weight = 1, sampled = 0, scale, total = 0, least = -1, need, budget = 0.9 * memory_limit * 1073741824;
+    struct stat st;
+    TOKENIZER *tk;
+    PMENT *rank;
+    char *word;
+
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || lseek(fd, 0, SEEK_CUR) != 0) {
+        fprintf(stderr, "-auto-plan samples the corpus before counting and needs it as a file on stdin; using the -memory heuristic.\n");
+        return 0;
+    }
+    /* Candidates: PLAN_STEPS per doubling up to the fully dense table, and the heuristic value for comparison */
+    full = (rows + 1) * cols;
+    for(k = 0; k < 63 * PLAN_STEPS && (g = (long long)pow(2.0, (real)k / PLAN_STEPS)) < full; k++) grid[ngrid++] = g;
+    grid[ngrid++] = full;
+    grid[ngrid++] = max_product;
+    qsort(grid, ngrid, sizeof(long long), compare_rank);
+    for(i = 1, k = 1; i < ngrid; i++) if(grid[i] != grid[k - 1]) grid[k++] = grid[i];
+    ngrid = k;
+    bins = calloc(ncounters * (ngrid + 1), sizeof(real));
+    spill = malloc(sizeof(real) * ngrid);
+    s = malloc(sizeof(long long) * cap);
+    if(bins == NULL || spill == NULL || s == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+
+    /* Sample whole lines from PLAN_CHUNKS evenly spaced offsets, or from the start if the corpus is small */
+    chunks = st.st_size > (long long)PLAN_CHUNKS * TOKEN_BLOCK_SIZE ? PLAN_CHUNKS : 1;
+    quota = plan_sample / chunks;
+    for(i = 0; i < chunks; i++) {
+        if(lseek(fd, st.st_size / chunks * i, SEEK_SET) < 0 || (tk = tokenizer_open(stdin)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        if(i > 0) while(get_token(tk, &word, &len) == TOKEN_WORD); // Skip the partial line
+        n = 0; line_tokens = 0; key_next = segments; weight_next = weighted; weight = 1;
+        do {
+            flag = get_token(tk, &word, &len);
+            if(flag != TOKEN_WORD) { // End of a line: the in-vocabulary words are in s[0 .. n-1]
+                if(session) { // Distinct words, counted as vocab_count -session 1 counts them
+                    qsort(s, n, sizeof(long long), compare_rank);
+                    for(j = 1, m = n > 0; j < n; j++) if(s[j] != s[m - 1]) s[m++] = s[j];
+                    n = m;
+                }
+                sampled += weight * n; // The share of the corpus sampled; a -weighted line still makes each record once
+                if(bipartite) { // Words on neither side are skipped like out-of-vocabulary words
+                    for(j = 0, m = 0; j < n; j++) if(side_rank[s[j]] != 0) s[m++] = s[j];
+                    n = m;
+                }
+                base = segment_local && seg > 0 ? segment_offset[seg - 1] : 0;
+                for(k = 0; k < ncounters; k++) {
+                    real *bin = bins + k * (ngrid + 1);
+                    int window = num_configs > 0 ? config_window[k] : window_size, sym = num_configs > 0 ? config_symmetric[k] : symmetric;
+                    if(session) { // Every pair, of a strided sample of the words above the cap
+                        stride = (n + session_cap - 1) / session_cap;
+                        for(j = 0, m = 0; j < n; j += stride) s[m++] = s[j];
+                        for(j = 0; j < m; j++) for(d = j + 1; d < m; d++) plan_pair(bin, grid, ngrid, s[j], s[d], 1, 1, base);
+                    }
+                    else for(j = 1; j < n; j++) for(d = 1; d <= window && d <= j; d++) plan_pair(bin, grid, ngrid, s[j - d], s[j], sym, 1, base);
+                }
+                tokens += line_tokens;
+                if(tokens >= quota * (i + 1)) break;
+                n = 0; line_tokens = 0; key_next = segments; weight_next = weighted; weight = 1;
+                continue;
+            }
+            if(weight_next) {weight_next = 0; weight = parse_line_weight(word); if(weight < 0) weight = 0; continue;}
+            if(key_next) {key_next = 0; seg = vocabhash_find(segment_hash, word, len, vocabhash_hash(word, len)) + 1; continue;}
+            if(weight <= 0 || (segments && seg == 0)) continue;
+            line_tokens++;
+            if((w = find_word(vocab_hash, word, len) + 1) == 0) continue;
+            if(segments) {
+                if((rank = pairmap_find(segment_ranks, seg, w)) == NULL) continue;
+                w = (long long)rank->val;
+            }
+            if(n == cap && (s = realloc(s, sizeof(long long) * (cap *= 2))) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+            s[n++] = w;
+        } while(flag != TOKEN_EOF);
+        tokenizer_close(tk);
+    }
+    lseek(fd, 0, SEEK_SET);
+    free(s);
+    if(sampled == 0) {
+        if(verbose > 0) fprintf(stderr, "plan: no in-vocabulary tokens in the sample; using the -memory heuristic.\n");
+        free(bins);
+        free(spill);
+        return 0;
+    }
+    scale = vocab_total / sampled;
+
+    /* Records per table above each candidate; the feasible candidates leave at least 1/16 of the memory to the overflow buffers */
+    for(k = 0; k < ncounters; k++) for(i = 0; i <= ngrid; i++) total += bins[k * (ngrid + 1) + i] * scale / ncounters;
+    for(i = ngrid - 1; i >= 0; i--) {
+        spill[i] = i + 1 < ngrid ? spill[i + 1] : 0;
+        for(k = 0; k < ncounters; k++) spill[i] += bins[k * (ngrid + 1) + i + 1] * scale / ncounters;
+    }
+    min_ovf = (long long)(budget / 16 / rec);
+    if(min_ovf < spill_buffers * (2 * (session ? session_cap : window_size) + 2)) min_ovf = spill_buffers * (2 * (session ? session_cap : window_size) + 2);
+    for(i = 0; i < ngrid && budget - (real)dense_size(grid[i], rows, cols) * elem >= (real)min_ovf * rec; i++)
+        if(least < 0 || spill[i] < least) least = spill[i];
+    if(least < 0) {
+        if(verbose > 0) fprintf(stderr, "plan: -memory is too small for any dense table; using the -memory heuristic.\n");
+        free(bins);
+        free(spill);
+        return 0;
+    }
+    for(best = 0; spill[best] > least + 0.005 * total; best++); // Smallest dense table within 0.5% of the records of the least spill
+    dense = dense_size(grid[best], rows, cols);
+    ovf = (long long)((budget - (real)dense * elem) / rec);
+    need = 1.25 * spill[best] * spill_buffers; // Each of the spill buffers holds a share of the overflow length
+    if(ovf > min_ovf && ovf > need) ovf = need > min_ovf ? (long long)need : min_ovf; // No more than the spill needs
+    runs = (long long)(spill[best] * spill_buffers / ovf) + 1;
+    if(verbose > 0) {
+        for(i = 0; grid[i] != max_product; i++);
+        fprintf(stderr, "plan: sampled %lld tokens at %d places, %.0f records%s estimated\n", tokens, chunks, total, ncounters > 1 ? " per table" : "");
+        fprintf(stderr, "plan: max product %lld -> dense table %.1f MB, overflow length %lld (%.1f MB), ~%.0f records spilled in ~%lld temp files%s\n",
+                grid[best], (real)dense * elem / 1048576, ovf, (real)ovf * rec / 1048576, spill[best], runs, ncounters > 1 ? " per table" : "");
+        fprintf(stderr, "plan: the -memory heuristic, max product %lld and overflow length %lld, would spill ~%.0f records in ~%lld temp files\n",
+                max_product, overflow_length, spill[i], (long long)(spill[i] * spill_buffers / overflow_length) + 1);
+        if(runs > PLAN_MAX_RUNS) fprintf(stderr, "plan: more than %d temp files expected; consider a larger -memory or -partitions\n", PLAN_MAX_RUNS);
+    }
+    max_product = grid[best];
+    overflow_length = ovf;
+    free(bins);
+    free(spill);
+    return 0;
+}
+
+/* Write out counter c once the corpus is counted: its dense table of rows rows goes to temp file 0 (or into the partitions),
+ * then all its temp files are merged into fout */
+int finish_counter(COUNTER *c, long long rows, FILE *fout) {
+    char filename[MAX_STRING_LENGTH + 40];
+    long long a, j, base = 0, s = 0;
+    int x, y, part = -1, err = 0;
+    FILE *fid;
+    RUNWRITER *dense = NULL;
+    real r;
+    
+    for(a = 0; a < c->stage_blocks; a++) flush_stage(c, a); // Apply the remaining staged updates
+    spiller_submit(c->spill, int_counts ? (void *)c->cri : (void *)c->cr, c->ind, c->fidcounter); // Written while the dense table goes out
+    sprintf(filename,"%s_0000.bin",c->head);
+    
+    /* Write out full bigram_table, skipping zeros */
+    if(verbose > 1) fprintf(stderr, "Writing cooccurrences to disk");
+    if(num_partitions > 0) { // The dense records are distributed over the partitions too, once the writer thread is done with them
+        if(spiller_finish(c->spill)) return 1;
+        fid = NULL;
+    }
+    else {
+        fid = fopen(filename,"w");
+        if(fid == NULL || (dense = run_writer_open(fid, int_counts)) == NULL) {fprintf(stderr, "Unable to write file %s.\n",filename); return 1;}
+    }
+    j = 1e6;
+    for(x = 1; x <= rows; x++) {
+        if( (long long) (0.75*log(rows / x)) < j) {j = (long long) (0.75*log(rows / x)); if(verbose > 1) fprintf(stderr,".");} // log's to make it look (sort of) pretty
+        if(segment_local) { // The columns of a row are ranks within its segment; the triangular ones count from the diagonal
+            while(x > segment_offset[s + 1]) s++;
+            base = segment_offset[s];
+        }
+        if(triangular) for(y = x; y < x + (c->lookup[x] - c->lookup[x-1]); y++) {
+            if((r = int_counts ? c->bigram_count[c->lookup[x-1] + y - x] : c->bigram_table[c->lookup[x-1] + y - x]) != 0) err |= chunk_put(&dense, fid, &part, x, y, r);
+        }
+        else for(y = 1; y <= (c->lookup[x] - c->lookup[x-1]); y++) {
+            if((r = int_counts ? c->bigram_count[c->lookup[x-1] - 2 + y] : c->bigram_table[c->lookup[x-1] - 2 + y]) != 0) err |= chunk_put(&dense, fid, &part, x, base + y, r);
+        }
+    }
+    
+    if(num_partitions > 0) {
+        if(verbose > 1) fprintf(stderr,"%d partitions.\n",num_partitions);
+        if((dense != NULL && run_writer_close(dense)) | err) {fprintf(stderr, "Unable to write partition files.\n"); return 1;}
+    }
+    else {
+        if(verbose > 1) fprintf(stderr,"%d files in total.\n",c->fidcounter + 1);
+        if(run_writer_close(dense) | fclose(fid) | err) {fprintf(stderr, "Unable to write file %s.\n",filename); return 1;}
+        if(spiller_finish(c->spill)) return 1;
+    }
+    huge_free(c->bigram_table, c->lookup[rows] * sizeof(real));
+    huge_free(c->bigram_count, c->lookup[rows] * sizeof(unsigned int));
+    free(c->stage);
+    free(c->stage_fill);
+    if(num_partitions > 0) return aggregate_partitions();
+    return merge_files(c->head, c->fidcounter + 1, fout); // Merge the sorted temporary files
+}
+
+/* Collect word-word cooccurrence counts from input stream, one table per counter */
 int get_cooccurrence() {
-    int flag, x, y, fidcounter = 1;
-    long long a, j = 0, k, id, counter = 0, ind = 0, vocab_size, w1, w2, *lookup, *history;
-    char format[20], filename[200], str[MAX_STRING_LENGTH + 1];
-    FILE *fid, *foverflow;
-    real *bigram_table, r;
-    HASHREC *htmp, **vocab_hash = inithashtable();
-    CREC *cr = malloc(sizeof(CREC) * (overflow_length + 1));
-    history = malloc(sizeof(long long) * window_size);
+    int flag, k, ncounters = num_configs > 0 ? num_configs : 1;
+    long long a, j = 0, id, counter = 0, vocab_size, w2, non_ids = 0;
+    long long bloom_rejects = 0, bloom_false_positives = 0, subsampled = 0, kept = 0, dropped = 0, lines = 0, weighted_lines = 0;
+    unsigned long long h, tok = 0;
+    char format[20], filename[MAX_STRING_LENGTH + 40], str[MAX_STRING_LENGTH + 1], key[MAX_STRING_LENGTH + 1], *word;
+    int len;
+    long long *vocab_counts = NULL, vocab_counts_cap = 0, vocab_total = 0, *lookup;
+    FILE *fid;
+    TOKENIZER *tk;
+    int inserted, key_next = segments, weight_next = weighted;
+    long long seg = 0, rows, cols;
+    PMENT *rank;
+    VOCABHASH *vocab_hash = int_tokens ? NULL : vocabhash_create(1048576);
+    BLOOM *bloom = NULL;
+    COUNTER *counters = calloc(ncounters, sizeof(COUNTER)), *c = counters;
+    COUNT_KERNEL *kernels = malloc(sizeof(COUNT_KERNEL) * ncounters);
+    HISTORY hist;
+    real *inv_dist;
     
-    fprintf(stderr, "COUNTING COOCCURRENCES\n");
-    if(verbose > 0) {
-        fprintf(stderr, "window size: %d\n", window_size);
-        if(symmetric == 0) fprintf(stderr, "context: asymmetric\n");
-        else fprintf(stderr, "context: symmetric\n");
+    if(counters == NULL || kernels == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
     }
-    if(verbose > 1) fprintf(stderr, "max product: %lld\n", max_product);
-    if(verbose > 1) fprintf(stderr, "overflow length: %lld\n", overflow_length);
-    sprintf(format,"%%%ds %%lld", MAX_STRING_LENGTH); // Format to read from vocab file, which has (irrelevant) frequency data
+    fprintf(stderr, "COUNTING COOCCURRENCES\n");
+    if(segments) sprintf(format,"%%%ds %%%ds %%lld", MAX_STRING_LENGTH, MAX_STRING_LENGTH); // Lines of vocab_count -segments 1 start with the segment key
+    else sprintf(format,"%%%ds %%lld", MAX_STRING_LENGTH); // Format to read from vocab file, which has (irrelevant) frequency data
     if(verbose > 1) fprintf(stderr, "Reading vocab from file \"%s\"...", vocab_file);
     fid = fopen(vocab_file,"r");
     if(fid == NULL) {fprintf(stderr,"Unable to open vocab file %s.\n",vocab_file); return 1;}
-    while(fscanf(fid, format, str, &id) != EOF) hashinsert(vocab_hash, str, ++j); // Here id is not used: inserting vocab words into hash table with their frequency rank, j
+    if(int_tokens ? (id_map = idmap_create(1048576)) == NULL : vocab_hash == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    if(segments && ((segment_hash = vocabhash_create(1024)) == NULL || (segment_ranks = pairmap_create(1048576)) == NULL)) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    while((segments ? fscanf(fid, format, key, str, &id) : fscanf(fid, format, str, &id)) != EOF) { // Interning vocab words in order, so insertion index + 1 is their frequency rank; id is the count
+        vocab_total += id;
+        if(num_partitions > 0 || subsample > 0) { // Counts balance the partitions and give the keep rates
+            if(j == vocab_counts_cap) {
+                vocab_counts_cap = vocab_counts_cap ? 2 * vocab_counts_cap : 1048576;
+                if((vocab_counts = realloc(vocab_counts, sizeof(long long) * vocab_counts_cap)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+            }
+            vocab_counts[j] = id;
+        }
+        if(bipartite && add_side_word(str, j + 1)) return 1;
+        if(segments) {
+            if(add_segment_word(vocab_hash, key, str, j + 1)) return 1;
+            j++;
+            continue;
+        }
+        if(intern_word(vocab_hash, str, &inserted) < 0) return 1;
+        if(!inserted) {fprintf(stderr, "Error, duplicate entry located: %s.\n", str); return 1;}
+        j++;
+    }
     fclose(fid);
     vocab_size = j;
     j = 0;
-    if(verbose > 1) fprintf(stderr, "loaded %lld words.\nBuilding lookup table...", vocab_size);
+    if(verbose > 1) fprintf(stderr, "loaded %lld words.\n", vocab_size);
+    if(segments) {
+        if((segment_opened = calloc(segment_hash->size + 1, sizeof(char))) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        if(verbose > 1) fprintf(stderr, "%lld segments, %lld distinct words.\n", segment_hash->size, int_tokens ? id_map->size : vocab_hash->size);
+        segment_local = !bipartite; // Bipartite segments keep sharing the source and target rank spaces
+        if(segment_local && !max_product_given) max_product = segment_max_product(vocab_size);
+    }
+    if(subsample > 0) { // Before the partitions reorder the counts
+        if((subsampled = init_keep_rates(vocab_counts, vocab_size)) < 0) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        if(verbose > 0) fprintf(stderr, "subsampling: threshold %g, %lld words kept at a rate below 1\n", subsample, subsampled);
+    }
+    rows = cols = vocab_size;
+    if(bipartite) {
+        rows = num_sources;
+        cols = num_targets;
+        if(verbose > 0) fprintf(stderr, "bipartite: %lld source items (%s*), %lld target items (%s*), %lld on neither side skipped\n",
+                num_sources, source_prefix, num_targets, target_prefix, vocab_size - num_sources - num_targets);
+        if(num_partitions > 0) for(a = 1; a <= num_sources; a++) vocab_counts[a-1] = vocab_counts[source_word[a]-1]; // Partitions split the source rows
+    }
+    if(num_partitions > 0 && init_partitions(vocab_counts, rows)) return 1;
+    free(vocab_counts);
+    if(session) {
+        c->session = malloc(sizeof(long long) * (vocab_size + 1));
+        c->session_seen = calloc(vocab_size + 1, sizeof(long long));
+        if(c->session == NULL || c->session_seen == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        c->session_id = 1;
+        c->rng = 88172645463325252ULL; // Fixed seed, so capped sessions sample the same words on every run
+    }
+    if(auto_plan && plan_memory(vocab_hash, vocab_total, rows, cols)) return 1;
+    if(spill_buffers < 1) spill_buffers = 1;
+    hist.len = 1;
+    for(k = 0; k < ncounters; k++) {
+        c = &counters[k];
+        c->window = num_configs > 0 ? config_window[k] : window_size;
+        c->symmetric = num_configs > 0 ? config_symmetric[k] : symmetric;
+        if(num_configs > 0) snprintf(c->head, sizeof(c->head), "%s_c%d", file_head, k); // Temp files of the tables must not collide
+        else strcpy(c->head, file_head);
+        kernels[k] = bipartite ? count_bipartite : select_count_kernel(c);
+        c->spill = spiller_create(spill_buffers, overflow_length, c->head);
+        if(c->spill == NULL) {
+            fprintf(stderr, "Couldn't allocate memory!");
+            return 1;
+        }
+        take_overflow_buffer(c);
+        c->spill_at = c->spill->buffer_length - 2 * c->window; // a target word adds at most 2 * window records
+        if(session) c->spill_at = c->spill->buffer_length - 2 * session_cap + 2; // count_session makes room for each row itself
+        if(c->window > hist.len) hist.len = c->window; // The largest window bounds the history
+    }
+    hist.pos = 0;
+    hist.words = malloc(sizeof(long long) * hist.len);
+    inv_dist = malloc(sizeof(real) * (hist.len + 1));
+    if(hist.words == NULL || inv_dist == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    for(a = 1; a <= hist.len; a++) inv_dist[a] = 1.0 / ((real)a); // Weight by inverse of distance between words
+    for(k = 0; k < ncounters; k++) counters[k].inv_dist = inv_dist;
     
-    /* Build auxiliary lookup table used to index into bigram_table */
-    lookup = (long long *)calloc( vocab_size + 1, sizeof(long long) );
+    if(verbose > 0) {
+        if(session) fprintf(stderr, "context: sessions (lines), at most %lld distinct words each%s\n", session_cap, triangular ? ", triangular storage" : "");
+        else if(num_configs > 0) {
+            for(k = 0; k < ncounters; k++) fprintf(stderr, "table %d: window size %d, %s context -> %s_%d%c.bin\n", k, counters[k].window,
+                    counters[k].symmetric ? (triangular ? "symmetric (triangular)" : "symmetric") : "asymmetric", config_output, counters[k].window, counters[k].symmetric ? 's' : 'a');
+        }
+        else {
+            fprintf(stderr, "window size: %d\n", window_size);
+            if(symmetric == 0) fprintf(stderr, "context: asymmetric\n");
+            else if(triangular) fprintf(stderr, "context: symmetric, triangular storage\n");
+            else fprintf(stderr, "context: symmetric\n");
+        }
+    }
+    if(verbose > 0 && int_counts) fprintf(stderr, "counts: 32-bit integer\n");
+    if(verbose > 1) fprintf(stderr, "max product: %lld\n", max_product);
+    if(verbose > 1) fprintf(stderr, "overflow length: %lld in %d buffers%s\n", overflow_length, spill_buffers, num_configs > 0 ? ", per table" : "");
+    if(c->spill_at < 1 && session) {fprintf(stderr, "Overflow length %lld is too small for session cap %lld and %d buffers.\n", overflow_length, session_cap, spill_buffers); return 1;}
+    for(k = 0; k < ncounters; k++) if(counters[k].spill_at < 1) {fprintf(stderr, "Overflow length %lld is too small for window size %d and %d buffers.\n", overflow_length, counters[k].window, spill_buffers); return 1;}
+    c = counters;
+    
+    /* Build the out-of-vocabulary filter from the hashes already stored in the vocab table */
+    if(bloom_fpr > 0) {
+        bloom = bloom_create(vocab_size, bloom_fpr);
+        if (bloom == NULL) {
+            fprintf(stderr, "Couldn't allocate memory!");
+            return 1;
+        }
+        if(int_tokens) {for(a = 0; a <= id_map->mask; a++) if(id_map->slots[a].idx != IM_EMPTY) bloom_add(bloom, idmap_hash(id_map->slots[a].id));}
+        else for(a = 0; a <= vocab_hash->mask; a++) if(vocab_hash->slots[a].idx != VH_EMPTY) bloom_add(bloom, vocab_hash->slots[a].hash);
+        if(verbose > 0) fprintf(stderr, "bloom filter: %.1f bits per word, %d hashes, %lld KB, expected false-positive rate %.4f\n",
+                bloom->bits_per_key, bloom->k, bloom->blocks * (BLOOM_BLOCK_BITS / 8) / 1024, bloom_expected_fpr(bloom, vocab_size));
+    }
+    if(verbose > 1) fprintf(stderr, "Building lookup table...");
+    
+    /* Build auxiliary lookup table used to index into bigram_table; the same for every counter */
+    lookup = (long long *)calloc( rows + 1, sizeof(long long) );
     if (lookup == NULL) {
         fprintf(stderr, "Couldn't allocate memory!");
         return 1;
     }
-    lookup[0] = 1;
-    for(a = 1; a <= vocab_size; a++) {
-        if((lookup[a] = max_product / a) < vocab_size) lookup[a] += lookup[a-1];
-        else lookup[a] = lookup[a-1] + vocab_size;
+    /* With segment_local, word index a is rank r = a - segment_offset[s] of its segment s, and the rows and columns are
+     * those of a table of the segment's n words; the kernels index from lookup + segment_offset[s] with ranks */
+    lookup[0] = triangular ? 0 : 1;
+    for(a = 1, seg = 0; a <= rows; a++) {
+        long long r = a, n = cols;
+        if(segment_local) {
+            while(a > segment_offset[seg + 1]) seg++;
+            r = a - segment_offset[seg];
+            n = segment_offset[seg + 1] - segment_offset[seg];
+        }
+        if(triangular) { /* Row r holds the pairs (r, b), r <= b, with (r + 1) * b <= max_product, at lookup[r-1] + b - r */
+            w2 = max_product / (r + 1) < n ? max_product / (r + 1) : n; // last b of the row
+            lookup[a] = lookup[a-1] + (w2 >= r ? w2 - r + 1 : 0);
+        }
+        else lookup[a] = lookup[a-1] + (max_product / r < n ? max_product / r : n);
     }
-    if(verbose > 1) fprintf(stderr, "table contains %lld elements.\n",lookup[a-1]);
+    seg = 0;
+    if(verbose > 1) fprintf(stderr, "table contains %lld elements%s.\n",lookup[a-1], ncounters > 1 ? ", per table" : "");
+    if(verbose > 0 && segment_local) fprintf(stderr, "segments: a dense region per segment, ranks within the segment below max product %lld, %lld elements in all\n", max_product, lookup[a-1]);
     
     /* Allocate memory for full array which will store all cooccurrence counts for words whose product of frequency ranks is less than max_product */
-    bigram_table = (real *)calloc( lookup[a-1] , sizeof(real) );
-    if (bigram_table == NULL) {
+    /* It is hit at random, so it is backed by huge pages and pre-faulted in parallel */
+    for(k = 0; k < ncounters; k++) {
+        c = &counters[k];
+        c->lookup = lookup;
+        if(int_counts) c->bigram_count = (unsigned int *)huge_alloc( lookup[a-1] * sizeof(unsigned int), hugepages, num_threads, "dense table", verbose > 1 && k == 0 );
+        else c->bigram_table = (real *)huge_alloc( lookup[a-1] * sizeof(real), hugepages, num_threads, "dense table", verbose > 1 && k == 0 );
+        if ((int_counts ? (void *)c->bigram_count : (void *)c->bigram_table) == NULL) {
+            fprintf(stderr, "Couldn't allocate memory!");
+            return 1;
+        }
+        if(block_accumulate > 0) {
+            if(init_stage(c, lookup[a-1])) {
+                fprintf(stderr, "Couldn't allocate memory!");
+                return 1;
+            }
+            if(verbose > 1 && k == 0) fprintf(stderr, "block accumulation: %lld blocks of %lld elements, %d pending updates each\n", c->stage_blocks, 1LL << c->stage_shift, c->stage_len);
+        }
+        c->fidcounter = 1;
+    }
+    c = counters;
+    
+    tk = tokenizer_open(stdin);
+    if (tk == NULL) {
         fprintf(stderr, "Couldn't allocate memory!");
         return 1;
     }
-    
-    fid = stdin;
-    sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-    sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
-    foverflow = fopen(filename,"w");
     if(verbose > 1) fprintf(stderr,"Processing token: 0");
     
-    /* For each token in input stream, calculate a weighted cooccurrence sum within window_size */
+    /* For each token in input stream, calculate a weighted cooccurrence sum within each counter's window */
     while (1) {
-        if(ind >= overflow_length - window_size) { // If overflow buffer is (almost) full, sort it and write it to temporary file
-            qsort(cr, ind, sizeof(CREC), compare_crec);
-            write_chunk(cr,ind,foverflow);
-            fclose(foverflow);
-            fidcounter++;
-            sprintf(filename,"%s_%04d.bin",file_head,fidcounter);
-            foverflow = fopen(filename,"w");
-            ind = 0;
-        }
-        flag = get_word(str, fid);
-        if(feof(fid)) break;
-        if(flag == 1) {j = 0; continue;} // Newline, reset line index (j)
+        for(k = 0; k < ncounters; k++) if(counters[k].ind >= counters[k].spill_at) spill_overflow(&counters[k]); // If overflow buffer is (almost) full, sort it and write it to temporary file
+        flag = get_token(tk, &word, &len);
+        if(flag == TOKEN_EOF) break;
+        if(flag == TOKEN_NEWLINE) { // Newline, reset line index (j) and window
+            if(session) count_session(c);
+            j = 0; hist.pos = 0; key_next = segments; weight_next = weighted; continue;
+        }
+        if(weight_next) { // Multiplicity of the line, 0 if malformed and the line is skipped
+            weight_next = 0;
+            if((line_weight = parse_line_weight(word)) < 0) {
+                fprintf(stderr, "Line weight %s is above %lld, the range of the counters.\n", word, MAX_LINE_WEIGHT);
+                return 1;
+            }
+            lines++;
+            weighted_lines += line_weight;
+            continue;
+        }
+        if(line_weight == 0) continue;
+        if(key_next) { // Segment key, 0 if the segment has no vocabulary and its line is skipped
+            key_next = 0;
+            seg = vocabhash_find(segment_hash, word, len, vocabhash_hash(word, len)) + 1;
+            if(segment_local && seg > 0) { // The line is counted in the region of its segment, by ranks within it
+                c->word_base = segment_offset[seg - 1];
+                c->lookup = lookup + c->word_base;
+            }
+            continue;
+        }
+        if(segments && seg == 0) continue;
         counter++;
         if((counter%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[19G%lld",counter);
-        htmp = hashsearch(vocab_hash, str);
-        if (htmp == NULL) continue; // Skip out-of-vocabulary words
-        w2 = htmp->id; // Target word (frequency rank)
-        for(k = j - 1; k >= ( (j > window_size) ? j - window_size : 0 ); k--) { // Iterate over all words to the left of target word, but not past beginning of line
-            w1 = history[k % window_size]; // Context word (frequency rank)
-            if ( w1 < max_product/w2 ) { // Product is small enough to store in a full array
-                bigram_table[lookup[w1-1] + w2 - 2] += 
-                        (noseq ? 1.0 : 1.0 / ((real)(j-k))); // Weight by inverse of distance between words
-                if(symmetric > 0) bigram_table[lookup[w2-1] + w1 - 2] += 
-                        (noseq ? 1.0 : 1.0 / ((real)(j-k))); // If symmetric context is used, exchange roles of w2 and w1 (ie look at right context too)
-            }
-            else { // Product is too big, data is likely to be sparse. Store these entries in a temporary buffer to be sorted, merged (accumulated), and written to file when it gets full.
-                cr[ind].word1 = w1;
-                cr[ind].word2 = w2;
-                cr[ind].val = (noseq ? 1.0 : 1.0 / ((real)(j-k)));
-                ind++; // Keep track of how full temporary buffer is
-                if(symmetric > 0) { // Symmetric context
-                    cr[ind].word1 = w2;
-                    cr[ind].word2 = w1;
-                    cr[ind].val = (noseq ? 1.0 : 1.0 / ((real)(j-k)));
-                    ind++;
-                }
+        if(int_tokens) {
+            if(!idmap_parse(word, len, &tok)) {non_ids++; continue;} // Not an id, so out of vocabulary
+            h = idmap_hash(tok);
+        }
+        else h = vocabhash_hash(word, len);
+        if (bloom != NULL && !bloom_maybe_contains(bloom, h)) {bloom_rejects++; continue;} // Cheap reject of most out-of-vocabulary words
+        w2 = (int_tokens ? idmap_find(id_map, tok, h) : vocabhash_find(vocab_hash, word, len, h)) + 1; // Target word (frequency rank)
+        if (w2 == 0) {bloom_false_positives++; continue;} // Skip out-of-vocabulary words
+        if(segments) { // Word index within the range of the segment, if the word is in the segment's vocabulary
+            if((rank = pairmap_find(segment_ranks, seg, w2)) == NULL) continue;
+            w2 = (long long)rank->val;
+        }
+        if(bipartite && side_rank[w2] == 0) continue; // Neither source nor target, as if out of vocabulary
+        if(subsample > 0) { // A dropped token keeps its place as an empty history slot, so the pairs around it are counted at their true distance
+            if(subsample_drop(w2)) {
+                dropped++;
+                hist.words[hist.pos] = 0;
+                hist.pos = (hist.pos + 1 == hist.len) ? 0 : hist.pos + 1;
+                j++;
+                continue;
             }
+            kept++;
+        }
+        if(segment_local) w2 -= c->word_base;
+        if(session) session_add(c, w2);
+        else if(bipartite) {
+            for(k = 0; k < ncounters; k++) kernels[k](&counters[k], &hist, side_rank[w2], j);
+            hist.words[hist.pos] = side_rank[w2];
+            hist.pos = (hist.pos + 1 == hist.len) ? 0 : hist.pos + 1;
+        }
+        else {
+            for(k = 0; k < ncounters; k++) kernels[k](&counters[k], &hist, w2, j);
+            hist.words[hist.pos] = w2; // Target word becomes context word in the future
+            hist.pos = (hist.pos + 1 == hist.len) ? 0 : hist.pos + 1;
         }
-        history[j % window_size] = w2; // Target word is stored in circular buffer to become context word in the future
         j++;
     }
     
     /* Write out temp buffer for the final time (it may not be full) */
     if(verbose > 1) fprintf(stderr,"\033[0GProcessed %lld tokens.\n",counter);
-    qsort(cr, ind, sizeof(CREC), compare_crec);
-    write_chunk(cr,ind,foverflow);
-    sprintf(filename,"%s_0000.bin",file_head);
+    if(bloom != NULL && verbose > 0) fprintf(stderr, "bloom filter: %lld out-of-vocabulary tokens, %lld rejected, %lld false positives (rate %.4f)\n",
+            bloom_rejects + bloom_false_positives, bloom_rejects, bloom_false_positives,
+            bloom_rejects + bloom_false_positives > 0 ? (real)bloom_false_positives / (bloom_rejects + bloom_false_positives) : 0);
+    if(subsample > 0 && verbose > 0) fprintf(stderr, "subsampling: dropped %lld of %lld in-vocabulary tokens (%.1f%%), skipping their window updates\n",
+            dropped, dropped + kept, dropped + kept > 0 ? 100.0 * dropped / (dropped + kept) : 0);
+    if(weighted && verbose > 0) fprintf(stderr, "weighted: %lld distinct lines counted for %lld lines\n", lines, weighted_lines);
+    if(non_ids > 0 && verbose > 0) fprintf(stderr, "int tokens: %lld tokens that are not ids skipped\n", non_ids);
+    bloom_free(bloom);
+    tokenizer_close(tk);
+    if(session) {
+        count_session(c); // The last line may lack a newline
+        if(verbose > 0) fprintf(stderr, "sessions: %lld, %lld capped at %lld words\n", c->sessions, c->sessions_capped, session_cap);
+        free(c->session);
+        free(c->session_seen);
+    }
+    c->lookup = lookup;
+    c->word_base = 0;
+    free(hist.words);
+    free(kernels);
+    vocabhash_free(vocab_hash);
+    idmap_free(id_map);
     
-    /* Write out full bigram_table, skipping zeros */
-    if(verbose > 1) fprintf(stderr, "Writing cooccurrences to disk");
-    fid = fopen(filename,"w");
-    j = 1e6;
-    for(x = 1; x <= vocab_size; x++) {
-        if( (long long) (0.75*log(vocab_size / x)) < j) {j = (long long) (0.75*log(vocab_size / x)); if(verbose > 1) fprintf(stderr,".");} // log's to make it look (sort of) pretty
-        for(y = 1; y <= (lookup[x] - lookup[x-1]); y++) {
-            if((r = bigram_table[lookup[x-1] - 2 + y]) != 0) {
-                fwrite(&x, sizeof(int), 1, fid);
-                fwrite(&y, sizeof(int), 1, fid);
-                fwrite(&r, sizeof(real), 1, fid);
-            }
+    /* The tables are written out one at a time, each freeing its dense table before its merge */
+    for(k = 0; k < ncounters; k++) {
+        c = &counters[k];
+        if(num_configs == 0) fid = stdout;
+        else {
+            sprintf(filename,"%s_%d%c.bin",config_output,c->window,c->symmetric ? 's' : 'a');
+            if((fid = fopen(filename,"wb")) == NULL) {fprintf(stderr, "Unable to write file %s.\n",filename); return 1;}
         }
+        if(finish_counter(c, rows, fid)) return 1;
+        if(fid != stdout && fclose(fid) != 0) {fprintf(stderr, "Unable to write file %s.\n",filename); return 1;}
     }
-    
-    if(verbose > 1) fprintf(stderr,"%d files in total.\n",fidcounter + 1);
-    fclose(fid);
-    fclose(foverflow);
-    free(cr);
+    if(segments) {
+        if((segment_fout != NULL && fclose(segment_fout) != 0) || segment_error) {fprintf(stderr, "Unable to write the segment tables.\n"); return 1;}
+        for(a = 0, k = 0; a < segment_hash->size; a++) { // A segment without any pair gets an empty table, so every table is there
+            k += segment_opened[a];
+            if(segment_opened[a]) continue;
+            sprintf(filename,"%s_%lld.bin",segment_output,a);
+            if((fid = fopen(filename,"wb")) == NULL || fclose(fid) != 0) {fprintf(stderr, "Unable to write file %s.\n",filename); return 1;}
+        }
+        if(verbose > 0) fprintf(stderr, "wrote %d segment tables with pairs to %s_<n>.bin\n", k, segment_output);
+        vocabhash_free(segment_hash);
+        pairmap_free(segment_ranks);
+        free(segment_offset);
+        free(segment_opened);
+    }
+    if(bipartite) {
+        free(side_rank);
+        free(source_word);
+        free(target_word);
+    }
+    free(keep_rate);
     free(lookup);
-    free(bigram_table);
-    free(vocab_hash);
-    return merge_files(fidcounter + 1); // Merge the sorted temporary files
+    free(inv_dist); // Still read by the last flush_stage of each counter
+    free(counters);
+    return 0;
 }
 
 int find_arg(char *str, int argc, char **argv) {
@@ -426,6 +1704,27 @@ int find_arg(char *str, int argc, char **argv) {
     return -1;
 }
 
+/* Parse a -configs list such as 5s,15s,50a (window size, then s for symmetric or a for left-only context, default
+ * -symmetric) into config_window and config_symmetric; returns 1 if it is malformed */
+int parse_configs(char *list) {
+    char *p, *end;
+    int k, i;
+    num_configs = 1;
+    for(p = list; *p; p++) if(*p == ',') num_configs++;
+    config_window = malloc(sizeof(int) * num_configs);
+    config_symmetric = malloc(sizeof(int) * num_configs);
+    if(config_window == NULL || config_symmetric == NULL) return 1;
+    for(p = list, k = 0; k < num_configs; k++, p = end + 1) {
+        config_window[k] = strtol(p, &end, 10);
+        if(end == p || config_window[k] < 1) return 1;
+        if(*end == 's' || *end == 'a') config_symmetric[k] = (*end++ == 's');
+        else config_symmetric[k] = symmetric > 0;
+        if(*end != (k + 1 < num_configs ? ',' : '\0')) return 1;
+        for(i = 0; i < k; i++) if(config_window[i] == config_window[k] && config_symmetric[i] == config_symmetric[k]) return 1; // Same output file
+    }
+    return 0;
+}
+
 int main(int argc, char **argv) {
     int i;
     real rlimit, n = 1e5;
@@ -440,6 +1739,22 @@ int main(int argc, char **argv) {
         printf("\t\tSet verbosity: 0, 1, or 2 (default)\n");
         printf("\t-symmetric <int>\n");
         printf("\t\tIf <int> = 0, only use left context; if <int> = 1 (default), use left and right\n");
+        printf("\t-triangular <int>\n");
+        printf("\t\tIf <int> = 1 (with -symmetric 1), store each unordered word pair once, halving the dense array and the temporary files;\n\t\tboth orientations are still written, but the output is ordered by unordered pair, each (a, b) followed by (b, a), rather than by word1. Default 0\n");
+        printf("\t-session <int>\n");
+        printf("\t\tIf <int> = 1, treat each line as a session (basket) and count every unordered pair of its distinct words once, in both orientations\n\t\t(once with -triangular 1); implies -noseq 1, ignores -window-size and -symmetric. Use vocab_count -session 1 for matching word counts. Default 0\n");
+        printf("\t-session-cap <int>\n");
+        printf("\t\tSessions with more than <int> distinct words are reduced to a random sample of <int> of them; default 1000\n");
+        printf("\t-configs <list>\n");
+        printf("\t\tCount several tables in one pass over the corpus, one per comma-separated entry <window>[s|a], e.g. 5s,15s,50a\n\t\t(s symmetric, a left context only, default -symmetric). Each table has its own dense array and overflow buffers, splitting -memory\n\t\tevenly, and is written to <prefix>_<window><s|a>.bin instead of stdout; overrides -window-size. Not available with -session\n");
+        printf("\t-config-output <prefix>\n");
+        printf("\t\tFilename prefix of the -configs tables\n");
+        printf("\t-source-prefix <str>, -target-prefix <str>\n");
+        printf("\t\tBipartite counting: only pairs of a source item (starting with the first prefix) and a target item (starting with the second)\n\t\tare counted, once per cooccurrence in either order, and only source rows are written. The dense array has source rows\n\t\tand target columns ranked within their side; other items are skipped like out-of-vocabulary words. -symmetric and -triangular do not apply\n");
+        printf("\t-segments <int>\n");
+        printf("\t\tIf <int> = 1, the first token of each line is a segment key and each segment gets its own table, counted in the same pass.\n\t\tReads the vocab file of vocab_count -segments 1; words are interned once and ranked within their segment.\n\t\tTables are written to <prefix>_<n>.bin in segment-local ranks instead of stdout,\n\t\tn numbering the segments from 0 in vocab file order. Each segment has a dense region of its own, for the pairs of its ranks\n\t\tbelow max product; the -memory heuristic is refit so the regions together take the elements of one table. With -source-prefix\n\t\tthe segments share one dense table of source and target ranks. Not available with -configs. Default 0\n");
+        printf("\t-segment-output <prefix>\n");
+        printf("\t\tFilename prefix of the -segments tables\n");
         printf("\t-window-size <int>\n");
         printf("\t\tNumber of context words to the left (and to the right, if symmetric = 1); default 15\n");
         printf("\t-vocab-file <file>\n");
@@ -447,11 +1762,41 @@ int main(int argc, char **argv) {
         printf("\t-memory <float>\n");
         printf("\t\tSoft limit for memory consumption, in GB -- based on simple heuristic, so not extremely accurate; default 4.0\n");
         printf("\t-max-product <int>\n");
-        printf("\t\tLimit the size of dense cooccurrence array by specifying the max product <int> of the frequency counts of the two cooccurring words.\n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n");
+        printf("\t\tLimit the size of dense cooccurrence array by specifying the max product <int> of the frequency counts of the two cooccurring words.\n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n\t\tWith -segments it bounds the product of ranks within a segment, in every segment's region\n");
         printf("\t-overflow-length <int>\n");
-        printf("\t\tLimit to length <int> the sparse overflow array, which buffers cooccurrence data that does not fit in the dense array, before writing to disk. \n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n");
+        printf("\t\tLimit to length <int> the sparse overflow array, which buffers cooccurrence data that does not fit in the dense array, before writing to disk. \n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n\t\tWith -segments it bounds the product of ranks within a segment, in every segment's region\n");
+        printf("\t-auto-plan <int>\n");
+        printf("\t\tIf <int> = 1, choose -max-product and -overflow-length for -memory from a sample of the corpus: estimate how many records each\n\t\tdense/sparse split would spill and take the smallest dense table that spills about as little as any that fits; the overflow\n\t\tbuffers get the rest, up to what the estimated spill needs. Prints the plan next to the heuristic's estimate. Needs the corpus as a file on stdin. Default 0\n");
+        printf("\t-plan-sample <int>\n");
+        printf("\t\tNumber of tokens -auto-plan samples, from 16 places of the corpus; default 2000000\n");
         printf("\t-overflow-file <file>\n");
         printf("\t\tFilename, excluding extension, for temporary files; default overflow\n");
+        printf("\t-partitions <int>\n");
+        printf("\t\tIf <int> > 0, distribute the overflow records over <int> partition files by ranges of word1 instead of sorting them into runs,\n\t\tthen sum each partition in an in-memory hash map, several partitions in parallel (-threads), and write them out in order.\n\t\tReplaces the k-way merge; choose <int> so that the distinct pairs of a partition times the threads fit in memory. Default 0 (sort-merge)\n");
+        printf("\t-topk <int>\n");
+        printf("\t\tWrite only the <int> largest counts of each word1 (ties keep the smaller word2), still ordered by word2; default 0 (all).\n\t\tSame selection as ranking by conditional frequency, since the count of word1 is fixed within its row. Not available with -triangular 1\n");
+        printf("\t-min-pair-count <float>\n");
+        printf("\t\tDo not write pairs with a smaller count; default 0\n");
+        printf("\t-subsample <float>\n");
+        printf("\t\tDrop tokens of frequent words as word2vec does: a word with frequency f (in its segment with -segments) is kept with probability\n\t\tsqrt(<float>/f) + <float>/f, e.g. 1e-4. Pairs are counted over the kept tokens and written divided by the keep rates of both words,\n\t\tan estimate of the full count (rounded with -int-counts). Not available with -session 1. Default 0 (off)\n");
+        printf("\t-weighted <int>\n");
+        printf("\t\tIf <int> = 1, the first token of each line is a count and the line is counted as that many copies of itself, as written by dedup\n\t\t(before the segment key with -segments 1); use vocab_count -weighted 1 on the same input. Counts above 4294967295\n\t\tare an error, and -int-counts counters saturate there. Not available with -block-accumulate 1. Default 0\n");
+        printf("\t-int-tokens <int>\n");
+        printf("\t\tIf <int> = 1, words are numeric ids looked up by value in an integer map, without hashing or comparing strings; tokens that are\n\t\tnot ids are out of vocabulary. Use vocab_count -int-tokens 1 for the vocab file. Not available with -source-prefix. Default 0\n");
+        printf("\t-temp-dir <dir>\n");
+        printf("\t\tDirectory for the temporary files, e.g. on a different disk than the input; default the current directory\n");
+        printf("\t-spill-buffers <int>\n");
+        printf("\t\tNumber of buffers the overflow array is split into; with more than one, full buffers are sorted and written\n\t\tto disk by a background thread while counting continues. 1 spills synchronously; default 2\n");
+        printf("\t-int-counts <int>\n");
+        printf("\t\tIf <int> = 1, count with 32-bit integers and write 12-byte records (int word1, int word2, unsigned int count) instead of 16-byte CRECs; requires -noseq 1.\n\t\tThe dense array then covers about twice as many pairs for the same -memory. Output is not readable by shuffle/glove. Default 0\n");
+        printf("\t-block-accumulate <int>\n");
+        printf("\t\tIf <int> = 1, buffer updates of the dense array per block of the array and apply a block when its buffer fills,\n\t\tso writes hit a cache-resident slice instead of scattering over the whole array. Helps when the dense array is much larger than the cache. Default 0\n");
+        printf("\t-hugepages <int>\n");
+        printf("\t\tPage size for the dense array and overflow buffer: 0 regular pages, 1 transparent huge pages (default), 2 explicit huge pages (falls back to 1)\n");
+        printf("\t-threads <int>\n");
+        printf("\t\tNumber of threads used to pre-fault the dense array and to aggregate partitions; default 0 (one per online CPU)\n");
+        printf("\t-bloom-fpr <float>\n");
+        printf("\t\tCheck tokens against a Bloom filter of the vocabulary with false-positive rate <float> before the hash lookup; default 0 (off).\n\t\tPays off when most tokens are out of vocabulary, e.g. with a high min-count or max-vocab.\n");
 
         printf("\nExample usage:\n");
         printf("./cooccur -verbose 2 -symmetric 0 -window-size 10 -vocab-file vocab.txt -memory 8.0 -overflow-file tempoverflow < corpus.txt > cooccurrences.bin\n\n");
@@ -461,23 +1806,137 @@ int main(int argc, char **argv) {
     if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-symmetric", argc, argv)) > 0) symmetric = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-window-size", argc, argv)) > 0) window_size = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-triangular", argc, argv)) > 0) triangular = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-session", argc, argv)) > 0) session = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-session-cap", argc, argv)) > 0) session_cap = atoll(argv[i + 1]);
+    if (session) symmetric = 1; // Session pairs are unordered
+    if (session_cap < 2) session_cap = 2;
+    if ((i = find_arg((char *)"-source-prefix", argc, argv)) > 0) source_prefix = argv[i + 1];
+    if ((i = find_arg((char *)"-target-prefix", argc, argv)) > 0) target_prefix = argv[i + 1];
+    if ((source_prefix == NULL) != (target_prefix == NULL)) {
+        fprintf(stderr, "-source-prefix and -target-prefix go together.\n");
+        return 1;
+    }
+    if (source_prefix != NULL) {
+        bipartite = 1;
+        if (triangular) fprintf(stderr, "-triangular 1 does not apply to source-target pairs; ignored.\n");
+        triangular = 0;
+    }
+    if ((i = find_arg((char *)"-segments", argc, argv)) > 0) segments = atoi(argv[i + 1]);
+    if (segments) {
+        if ((i = find_arg((char *)"-segment-output", argc, argv)) > 0) segment_output = argv[i + 1];
+        else {
+            fprintf(stderr, "-segments needs -segment-output for the names of its tables.\n");
+            return 1;
+        }
+        if (find_arg((char *)"-configs", argc, argv) > 0) {
+            fprintf(stderr, "-segments and -configs cannot be combined.\n");
+            return 1;
+        }
+    }
+    if ((i = find_arg((char *)"-configs", argc, argv)) > 0) {
+        if (parse_configs(argv[i + 1])) {
+            fprintf(stderr, "Malformed -configs list %s; expected distinct entries like 5s,15s,50a.\n", argv[i + 1]);
+            return 1;
+        }
+        if ((i = find_arg((char *)"-config-output", argc, argv)) > 0) config_output = argv[i + 1];
+        else {
+            fprintf(stderr, "-configs needs -config-output for the names of its tables.\n");
+            return 1;
+        }
+        if (session) {
+            fprintf(stderr, "-configs sets windows, which -session 1 does not use.\n");
+            return 1;
+        }
+        window_size = 1;
+        for (i = 0; i < num_configs; i++) {
+            if (config_window[i] > window_size) window_size = config_window[i]; // Checks below concern the largest window
+            if (!config_symmetric[i]) symmetric = 0; // Triangular storage needs every table symmetric
+        }
+    }
+    if (triangular && symmetric == 0) {
+        fprintf(stderr, "-triangular 1 only applies to symmetric contexts; ignored with -symmetric 0.\n");
+        triangular = 0;
+    }
     if ((i = find_arg((char *)"-vocab-file", argc, argv)) > 0) strcpy(vocab_file, argv[i + 1]);
     else strcpy(vocab_file, (char *)"vocab.txt");
     if ((i = find_arg((char *)"-overflow-file", argc, argv)) > 0) strcpy(file_head, argv[i + 1]);
     else strcpy(file_head, (char *)"overflow");
+    if ((i = find_arg((char *)"-temp-dir", argc, argv)) > 0) {
+        char *name = strdup(file_head);
+        snprintf(file_head, MAX_STRING_LENGTH, "%s/%s", argv[i + 1], name);
+        free(name);
+    }
+    if ((i = find_arg((char *)"-spill-buffers", argc, argv)) > 0) spill_buffers = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-partitions", argc, argv)) > 0) num_partitions = atoi(argv[i + 1]);
+    if (num_partitions > 0 && num_configs > 0) {
+        fprintf(stderr, "-partitions is not available with -configs; using the sort-merge.\n");
+        num_partitions = 0;
+    }
+    if ((i = find_arg((char *)"-min-pair-count", argc, argv)) > 0) min_pair_count = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-topk", argc, argv)) > 0) topk = atoi(argv[i + 1]);
+    if (topk > 0 && triangular) {
+        fprintf(stderr, "-topk needs output ordered by word1, which -triangular 1 does not produce.\n");
+        return 1;
+    }
+    if (topk > 0 && (row_heap = malloc(sizeof(CREC) * topk)) == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
     if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
     if ((i = find_arg((char *)"-noseq", argc, argv)) > 0) noseq = atoi(argv[i+1]);
+    if (session) noseq = 1; // Every pair of a session counts 1
+    if ((i = find_arg((char *)"-bloom-fpr", argc, argv)) > 0) bloom_fpr = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-subsample", argc, argv)) > 0) subsample = atof(argv[i + 1]);
+    if (subsample > 0 && session) { // A word m times in a line survives with 1 - (1 - keep)^m, which no pair correction knows
+        fprintf(stderr, "-subsample cannot be combined with -session 1: a session counts each word once however often it occurs.\n");
+        return 1;
+    }
+    if ((i = find_arg((char *)"-int-counts", argc, argv)) > 0) int_counts = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-block-accumulate", argc, argv)) > 0) block_accumulate = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-hugepages", argc, argv)) > 0) hugepages = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+    if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if ((i = find_arg((char *)"-weighted", argc, argv)) > 0) weighted = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-int-tokens", argc, argv)) > 0) int_tokens = atoi(argv[i + 1]);
+    if (int_tokens && bipartite) {
+        fprintf(stderr, "-int-tokens 1 cannot be combined with -source-prefix: ids carry no prefix.\n");
+        return 1;
+    }
+    if (block_accumulate && weighted) {
+        fprintf(stderr, "-block-accumulate stages unit updates; ignored with -weighted 1.\n");
+        block_accumulate = 0;
+    }
+    if (block_accumulate && !noseq && window_size > 255) {
+        fprintf(stderr, "-block-accumulate stores distances in 8 bits; ignored for distance-weighted windows above 255.\n");
+        block_accumulate = 0;
+    }
+    if (int_counts && !noseq) {
+        fprintf(stderr, "-int-counts 1 requires -noseq 1, distance-weighted counts are not integers.\n");
+        return 1;
+    }
 
     /* The memory_limit determines a limit on the number of elements in bigram_table and the overflow buffer */
     /* Estimate the maximum value that max_product can take so that this limit is still satisfied */
-    rlimit = 0.85 * (real)memory_limit * 1073741824/(sizeof(CREC));
+    /* With -int-counts the dense elements are half the size (4 instead of 8 bytes), so the same budget holds twice as many */
+    /* Triangular storage keeps half of the pairs below max_product, so the same budget covers twice as many */
+    /* With -configs the budget is split evenly between the tables */
+    if (num_configs > 0) memory_limit /= num_configs;
+    rlimit = 0.85 * (real)memory_limit * 1073741824/(sizeof(CREC)) * sizeof(real) / (int_counts ? sizeof(unsigned int) : sizeof(real)) * (triangular ? 2 : 1);
     while(fabs(rlimit - n * (log(n) + 0.1544313298)) > 1e-3) n = rlimit / (log(n) + 0.1544313298);
     max_product = (long long) n;
-    overflow_length = (long long) rlimit/6; // 0.85 + 1/6 ~= 1
+    overflow_length = (long long) (0.85 * (real)memory_limit * 1073741824/6) / (int_counts ? sizeof(CRECI) : sizeof(CREC)); // 0.85 + 1/6 ~= 1
     
     /* Override estimates by specifying limits explicitly on the command line */
-    if ((i = find_arg((char *)"-max-product", argc, argv)) > 0) max_product = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-max-product", argc, argv)) > 0) {max_product = atoll(argv[i + 1]); max_product_given = 1;}
     if ((i = find_arg((char *)"-overflow-length", argc, argv)) > 0) overflow_length = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-auto-plan", argc, argv)) > 0) auto_plan = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-plan-sample", argc, argv)) > 0) plan_sample = atoll(argv[i + 1]);
+    if (auto_plan && (find_arg((char *)"-max-product", argc, argv) > 0 || find_arg((char *)"-overflow-length", argc, argv) > 0)) {
+        fprintf(stderr, "-max-product or -overflow-length given; -auto-plan ignored.\n");
+        auto_plan = 0;
+    }
+    if (plan_sample < 1) plan_sample = 1;
     
     fprintf(stderr, "COOCCUR noseq = %d\n", noseq);
     return get_cooccurrence();
@@ -0,0 +1,271 @@
+//  Tool to collapse duplicate lines of a corpus into weighted lines, for vocab_count and cooccur -weighted 1
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "vocab_hash.h"
+
+#define MAX_STRING_LENGTH 1000
+
+typedef double real;
+
+/* A distinct line of the table, ordered by hash for the runs */
+typedef struct line_ref {
+    unsigned long long hash;
+    long long idx;
+} LINEREF;
+
+/* Current record of a run being merged */
+typedef struct run_head {
+    FILE *fin;
+    unsigned long long hash;
+    long long count;
+    unsigned int len;
+    unsigned int cap;
+    char *line;
+} RUNHEAD;
+
+int verbose = 2; // 0, 1, or 2
+real memory_limit = 1.0; // soft limit, in gigabytes, on the table of distinct lines
+char *file_head; // temporary file prefix, including the -temp-dir
+VOCABHASH *table; // distinct lines of the current chunk
+long long *counts, counts_cap; // multiplicity of each line of the table
+
+/* Efficient string comparison */
+int scmp( char *s1, char *s2 ) {
+    while(*s1 != '\0' && *s1 == *s2) {s1++; s2++;}
+    return(*s1 - *s2);
+}
+
+/* Bytes held by the table and its counts */
+long long table_bytes() {
+    return table->arena_len + (table->mask + 1) * (long long)sizeof(VHENT) + table->size * (long long)(2 * sizeof(long long));
+}
+
+/* Order of the runs: hash, then length and bytes */
+int compare_key(unsigned long long h1, const char *s1, unsigned int n1, unsigned long long h2, const char *s2, unsigned int n2) {
+    int c;
+    if(h1 != h2) return h1 < h2 ? -1 : 1;
+    if(n1 != n2) return n1 < n2 ? -1 : 1;
+    c = memcmp(s1, s2, n1);
+    return (c > 0) - (c < 0);
+}
+
+int compare_ref(const void *a, const void *b) {
+    const LINEREF *x = (const LINEREF *)a, *y = (const LINEREF *)b;
+    const char *s1 = vocabhash_word(table, x->idx), *s2 = vocabhash_word(table, y->idx);
+    return compare_key(x->hash, s1, strlen(s1), y->hash, s2, strlen(s2));
+}
+
+/* Sort the table by hash into temp file number num and empty it; returns 1 on failure */
+int spill_table(int num) {
+    char filename[MAX_STRING_LENGTH + 20];
+    long long a, n = 0;
+    unsigned int len;
+    LINEREF *refs = malloc(sizeof(LINEREF) * (table->size + 1));
+    FILE *fout;
+
+    sprintf(filename, "%s_%04d.bin", file_head, num);
+    if(refs == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    if((fout = fopen(filename, "wb")) == NULL) {fprintf(stderr, "Unable to write file %s.\n", filename); return 1;}
+    for(a = 0; a <= table->mask; a++) if(table->slots[a].idx != VH_EMPTY) {
+        refs[n].hash = table->slots[a].hash;
+        refs[n++].idx = table->slots[a].idx;
+    }
+    qsort(refs, n, sizeof(LINEREF), compare_ref);
+    for(a = 0; a < n; a++) {
+        len = strlen(vocabhash_word(table, refs[a].idx));
+        fwrite(&refs[a].hash, sizeof(unsigned long long), 1, fout);
+        fwrite(&counts[refs[a].idx], sizeof(long long), 1, fout);
+        fwrite(&len, sizeof(unsigned int), 1, fout);
+        fwrite(vocabhash_word(table, refs[a].idx), 1, len, fout);
+    }
+    free(refs);
+    if(fclose(fout) != 0) {fprintf(stderr, "Unable to write file %s.\n", filename); return 1;}
+    vocabhash_free(table);
+    if((table = vocabhash_create(1024)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    return 0;
+}
+
+/* Read the next record of run r, return 0 at end of file */
+int read_head(RUNHEAD *r) {
+    if(fread(&r->hash, sizeof(unsigned long long), 1, r->fin) != 1) return 0;
+    if(fread(&r->count, sizeof(long long), 1, r->fin) != 1 || fread(&r->len, sizeof(unsigned int), 1, r->fin) != 1) return 0;
+    if(r->len + 1 > r->cap) {
+        r->cap = 2 * (r->len + 1);
+        if((r->line = realloc(r->line, r->cap)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); exit(1);}
+    }
+    if(fread(r->line, 1, r->len, r->fin) != r->len) return 0;
+    r->line[r->len] = 0;
+    return 1;
+}
+
+static inline int head_less(RUNHEAD *a, RUNHEAD *b) {
+    return compare_key(a->hash, a->line, a->len, b->hash, b->line, b->len) < 0;
+}
+
+/* Restore the heap order of pq below position i */
+void sift_down(RUNHEAD **pq, int n, int i) {
+    int j;
+    RUNHEAD *t;
+    while((j = 2 * i + 1) < n) {
+        if(j + 1 < n && head_less(pq[j + 1], pq[j])) j++;
+        if(!head_less(pq[j], pq[i])) break;
+        t = pq[i]; pq[i] = pq[j]; pq[j] = t;
+        i = j;
+    }
+}
+
+/* Merge the num sorted runs, adding up the counts of equal lines, and write the weighted lines to stdout */
+long long merge_runs(int num) {
+    char filename[MAX_STRING_LENGTH + 20];
+    int i, n = 0;
+    long long distinct = 0, count;
+    RUNHEAD *runs = calloc(num, sizeof(RUNHEAD)), **pq = malloc(sizeof(RUNHEAD *) * num), *top;
+    char *line = NULL;
+    unsigned int cap = 0, len;
+    unsigned long long hash;
+
+    if(runs == NULL || pq == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return -1;}
+    for(i = 0; i < num; i++) {
+        sprintf(filename, "%s_%04d.bin", file_head, i);
+        if((runs[i].fin = fopen(filename, "rb")) == NULL) {fprintf(stderr, "Unable to open file %s.\n", filename); return -1;}
+        if(read_head(&runs[i])) pq[n++] = &runs[i];
+    }
+    for(i = n / 2 - 1; i >= 0; i--) sift_down(pq, n, i);
+    while(n > 0) {
+        top = pq[0];
+        if(top->len + 1 > cap) {
+            cap = 2 * (top->len + 1);
+            if((line = realloc(line, cap)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return -1;}
+        }
+        memcpy(line, top->line, top->len + 1);
+        len = top->len;
+        hash = top->hash;
+        count = 0;
+        while(n > 0 && pq[0]->hash == hash && pq[0]->len == len && memcmp(pq[0]->line, line, len) == 0) { // The same line from every run that has it
+            count += pq[0]->count;
+            if(!read_head(pq[0])) pq[0] = pq[--n];
+            sift_down(pq, n, 0);
+        }
+        printf("%lld %s\n", count, line);
+        distinct++;
+    }
+    for(i = 0; i < num; i++) {
+        fclose(runs[i].fin);
+        free(runs[i].line);
+        sprintf(filename, "%s_%04d.bin", file_head, i);
+        remove(filename);
+    }
+    free(line);
+    free(runs);
+    free(pq);
+    return distinct;
+}
+
+/* Collapse the lines of stdin; in memory as long as the distinct lines fit, else sorted by hash through temp files */
+int dedup_lines() {
+    char *buf = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    long long idx, lines = 0, distinct, limit = (long long)(memory_limit * 1073741824);
+    int inserted, num_runs = 0;
+
+    fprintf(stderr, "COLLAPSING DUPLICATE LINES\n");
+    table = vocabhash_create(1024);
+    counts_cap = 1024;
+    counts = malloc(sizeof(long long) * counts_cap);
+    if(table == NULL || counts == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    while((len = getline(&buf, &cap, stdin)) != -1) {
+        if(len > 0 && buf[len - 1] == '\n') buf[--len] = 0;
+        if(len == 0) continue; // Counts nothing
+        lines++;
+        idx = vocabhash_insert(table, buf, len, vocabhash_hash(buf, len), &inserted);
+        if(idx < 0) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        if(idx == counts_cap) {
+            counts_cap *= 2;
+            if((counts = realloc(counts, sizeof(long long) * counts_cap)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        }
+        if(inserted) counts[idx] = 0;
+        counts[idx]++;
+        if((lines % 100000) == 0 && verbose > 1) fprintf(stderr, "\033[0GProcessed %lld lines.", lines);
+        if(inserted && table_bytes() > limit && spill_table(num_runs++)) return 1;
+    }
+    free(buf);
+    if(verbose > 1) fprintf(stderr, "\033[0GProcessed %lld lines.\n", lines);
+    if(num_runs == 0) { // Everything fit, write the lines in order of their first occurrence
+        for(idx = 0; idx < table->size; idx++) printf("%lld %s\n", counts[idx], vocabhash_word(table, idx));
+        distinct = table->size;
+    }
+    else {
+        if(table->size > 0 && spill_table(num_runs++)) return 1;
+        if(verbose > 1) fprintf(stderr, "Merging %d temp files...\n", num_runs);
+        if((distinct = merge_runs(num_runs)) < 0) return 1;
+    }
+    vocabhash_free(table);
+    free(counts);
+    if(verbose > 0) fprintf(stderr, "%lld lines, %lld distinct (%.1f%% duplicates)\n", lines, distinct, lines > 0 ? 100.0 * (lines - distinct) / lines : 0);
+    return 0;
+}
+
+int find_arg(char *str, int argc, char **argv) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        if(!scmp(str, argv[i])) {
+            if (i == argc - 1) {
+                printf("No argument given for %s\n", str);
+                exit(1);
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int i;
+    file_head = malloc(sizeof(char) * MAX_STRING_LENGTH);
+
+    if (argc == 1) {
+        printf("Tool to collapse duplicate lines of a corpus into weighted lines\n\n");
+        printf("Each distinct non-empty line is written once as '<count> <line>', to be read by vocab_count and cooccur with -weighted 1,\n");
+        printf("which then tokenize and count it once, scaled by <count>. Lines are written in order of first occurrence if the distinct\n");
+        printf("lines fit in -memory, else in hash order.\n\n");
+        printf("Usage options:\n");
+        printf("\t-verbose <int>\n");
+        printf("\t\tSet verbosity: 0, 1, or 2 (default)\n");
+        printf("\t-memory <float>\n");
+        printf("\t\tSoft limit for the table of distinct lines, in GB; beyond it the table is sorted by hash into a temp file and\n\t\tthe temp files are merged at the end. Default 1.0\n");
+        printf("\t-temp-file <file>\n");
+        printf("\t\tFilename, excluding extension, for temporary files; default temp_dedup\n");
+        printf("\t-temp-dir <dir>\n");
+        printf("\t\tDirectory for the temporary files; default the current directory\n");
+        printf("\nExample usage:\n");
+        printf("./dedup -verbose 2 -memory 2.0 < corpus.txt > corpus.dedup.txt\n");
+        return 0;
+    }
+
+    if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-temp-file", argc, argv)) > 0) strcpy(file_head, argv[i + 1]);
+    else strcpy(file_head, (char *)"temp_dedup");
+    if ((i = find_arg((char *)"-temp-dir", argc, argv)) > 0) {
+        char *name = strdup(file_head);
+        snprintf(file_head, MAX_STRING_LENGTH, "%s/%s", argv[i + 1], name);
+        free(name);
+    }
+    return dedup_lines();
+}
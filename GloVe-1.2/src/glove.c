@@ -27,6 +27,7 @@
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include "hugepage.h"
 
 #define _FILE_OFFSET_BITS 64
 #define MAX_STRING_LENGTH 1000
@@ -45,6 +46,7 @@ int num_threads = 8; // pthreads
 int num_iter = 25; // Number of full passes through cooccurrence matrix
 int vector_size = 50; // Word vector size
 int save_gradsq = 0; // By default don't save squared gradient values
+int hugepages = HUGEPAGE_THP; // 0: regular pages; 1: transparent huge pages; 2: explicit huge pages, falling back to transparent ones
 int use_binary = 1; // 0: save as text files; 1: save as binary; 2: both. For binary, save both word and context word vectors.
 int model = 2; // For text file output only. 0: concatenate word and context vectors (and biases) i.e. save everything; 1: Just save word vectors (no bias); 2: Save (word + context word) vectors (no biases)
 real eta = 0.05; // Initial learning rate
@@ -64,12 +66,13 @@ void initialize_parameters() {
 	vector_size++; // Temporarily increment to allocate space for bias
     
 	/* Allocate space for word vectors and context word vectors, and correspodning gradsq */
-	a = posix_memalign((void **)&W, 128, 2 * vocab_size * vector_size * sizeof(real)); // Might perform better than malloc
+	/* W and gradsq are updated at random rows by every thread, so back them with huge pages to cut TLB misses */
+	W = huge_alloc(2 * vocab_size * vector_size * sizeof(real), hugepages, num_threads, "W", verbose > 1);
     if (W == NULL) {
         fprintf(stderr, "Error allocating memory for W\n");
         exit(1);
     }
-    a = posix_memalign((void **)&gradsq, 128, 2 * vocab_size * vector_size * sizeof(real)); // Might perform better than malloc
+    gradsq = huge_alloc(2 * vocab_size * vector_size * sizeof(real), hugepages, num_threads, "gradsq", verbose > 1);
 	if (gradsq == NULL) {
         fprintf(stderr, "Error allocating memory for gradsq\n");
         exit(1);
@@ -318,6 +321,8 @@ int main(int argc, char **argv) {
         printf("\t\tFilename, excluding extension, for squared gradient output; default gradsq\n");
         printf("\t-save-gradsq <int>\n");
         printf("\t\tSave accumulated squared gradients; default 0 (off); ignored if gradsq-file is specified\n");
+        printf("\t-hugepages <int>\n");
+        printf("\t\tPage size for W and gradsq: 0 regular pages, 1 transparent huge pages (default), 2 explicit huge pages (falls back to 1)\n");
         printf("\nExample usage:\n");
         printf("./glove -input-file cooccurrence.shuf.bin -vocab-file vocab.txt -save-file vectors -gradsq-file gradsq -verbose 2 -vector-size 100 -threads 16 -alpha 0.75 -x-max 100.0 -eta 0.05 -binary 2 -model 2\n\n");
         return 0;
@@ -336,6 +341,7 @@ int main(int argc, char **argv) {
     if ((i = find_arg((char *)"-model", argc, argv)) > 0) model = atoi(argv[i + 1]);
     if(model != 0 && model != 1) model = 2;
     if ((i = find_arg((char *)"-save-gradsq", argc, argv)) > 0) save_gradsq = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-hugepages", argc, argv)) > 0) hugepages = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-vocab-file", argc, argv)) > 0) strcpy(vocab_file, argv[i + 1]);
     else strcpy(vocab_file, (char *)"vocab.txt");
     if ((i = find_arg((char *)"-save-file", argc, argv)) > 0) strcpy(save_W_file, argv[i + 1]);
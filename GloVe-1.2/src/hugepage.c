@@ -0,0 +1,153 @@
+//  Huge-page backed allocation for the large randomly accessed arrays of cooccur and glove
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "hugepage.h"
+
+#define HUGE_ALIGN (2UL << 20) // transparent huge pages need 2MB-aligned regions
+#define MIN_PREFAULT_PER_THREAD (64UL << 20)
+
+typedef struct prefault_arg {
+    char *start;
+    size_t len;
+    size_t step;
+} PREFAULT_ARG;
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+/* Default size of explicit huge pages, from /proc/meminfo; 0 if unknown */
+static size_t hugetlb_page_size() {
+    char line[256];
+    size_t kb = 0;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1) break;
+    fclose(f);
+    return kb << 10;
+}
+
+/* Bytes of the mapping containing p that are backed by transparent huge pages, from /proc/self/smaps; -1 if unknown */
+static long long thp_backed_bytes(void *p) {
+    char line[512];
+    unsigned long start, end;
+    long long kb = -1;
+    int inside = 0;
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2 && strchr(line, '-') < strchr(line, ' ')) {
+            if (inside) break;
+            inside = (uintptr_t)p >= start && (uintptr_t)p < end;
+        }
+        else if (inside && sscanf(line, "AnonHugePages: %lld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb < 0 ? -1 : kb << 10;
+}
+
+static void *prefault_thread(void *varg) {
+    PREFAULT_ARG *arg = (PREFAULT_ARG *)varg;
+    size_t off;
+    for (off = 0; off < arg->len; off += arg->step) arg->start[off] = 0;
+    return NULL;
+}
+
+/* Touch every page of [p, p + len) so the faults are taken in parallel now rather than one by one while counting */
+static void prefault(char *p, size_t len, size_t page, int threads) {
+    pthread_t *pt = NULL;
+    PREFAULT_ARG *args;
+    size_t chunk;
+    int t, started = 0;
+    if (threads > 1 && len / threads < MIN_PREFAULT_PER_THREAD) threads = len / MIN_PREFAULT_PER_THREAD;
+    if (threads < 1) threads = 1;
+    args = malloc(sizeof(PREFAULT_ARG) * threads);
+    if (threads > 1) pt = malloc(sizeof(pthread_t) * threads);
+    if (args == NULL || (threads > 1 && pt == NULL)) {
+        PREFAULT_ARG one = {p, len, page};
+        prefault_thread(&one);
+        free(args);
+        free(pt);
+        return;
+    }
+    chunk = round_up(len / threads + 1, page);
+    for (t = 0; t < threads; t++) {
+        args[t].start = p + chunk * t;
+        args[t].len = (chunk * t >= len) ? 0 : (len - chunk * t < chunk ? len - chunk * t : chunk);
+        args[t].step = page;
+    }
+    /* Threads that fail to start leave their share to the calling thread */
+    for (t = 1; t < threads && pthread_create(&pt[t], NULL, prefault_thread, &args[t]) == 0; t++) started = t;
+    prefault_thread(&args[0]);
+    for (t = started + 1; t < threads; t++) prefault_thread(&args[t]);
+    for (t = 1; t <= started; t++) pthread_join(pt[t], NULL);
+    free(pt);
+    free(args);
+}
+
+void *huge_alloc(size_t bytes, int mode, int threads, const char *what, int verbose) {
+    size_t len = round_up(bytes > 0 ? bytes : 1, HUGE_ALIGN), page = sysconf(_SC_PAGESIZE), hpage;
+    char *p = MAP_FAILED, *aligned;
+    long long backed;
+
+#ifdef MAP_HUGETLB
+    if (mode >= HUGEPAGE_EXPLICIT && (hpage = hugetlb_page_size()) > 0 && hpage <= HUGE_ALIGN) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            if (threads > 0) prefault(p, len, hpage, threads);
+            if (verbose > 0) fprintf(stderr, "%s: %.1f MB in %zu kB explicit huge pages\n", what, len / 1048576.0, hpage >> 10);
+            return p;
+        }
+        if (verbose > 0) fprintf(stderr, "%s: no explicit huge pages available, falling back to transparent huge pages\n", what);
+    }
+#endif
+
+    /* Over-map by one huge page so the region can start on a 2MB boundary, then trim both ends */
+    p = mmap(NULL, len + HUGE_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    aligned = (char *)round_up((uintptr_t)p, HUGE_ALIGN);
+    if (aligned > p) munmap(p, aligned - p);
+    munmap(aligned + len, p + HUGE_ALIGN - aligned);
+    p = aligned;
+
+#ifdef MADV_HUGEPAGE
+    if (mode >= HUGEPAGE_THP && madvise(p, len, MADV_HUGEPAGE) != 0 && verbose > 0)
+        fprintf(stderr, "%s: madvise(MADV_HUGEPAGE) failed, transparent huge pages are disabled\n", what);
+#endif
+    if (mode >= HUGEPAGE_THP && threads > 0) prefault(p, len, page, threads);
+
+    if (verbose > 0) {
+        backed = (mode >= HUGEPAGE_THP) ? thp_backed_bytes(p) : 0;
+        if (mode >= HUGEPAGE_THP && threads <= 0)
+            fprintf(stderr, "%s: %.1f MB, transparent huge pages requested, faulted in on first use\n", what, len / 1048576.0);
+        else if (backed > 0)
+            fprintf(stderr, "%s: %.1f MB, %.0f%% in 2048 kB transparent huge pages\n", what, len / 1048576.0, 100.0 * (backed > (long long)len ? (long long)len : backed) / len);
+        else
+            fprintf(stderr, "%s: %.1f MB in %zu kB pages\n", what, len / 1048576.0, page >> 10);
+    }
+    return p;
+}
+
+void huge_free(void *p, size_t bytes) {
+    if (p == NULL) return;
+    munmap(p, round_up(bytes > 0 ? bytes : 1, HUGE_ALIGN));
+}
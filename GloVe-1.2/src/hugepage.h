@@ -0,0 +1,34 @@
+//  Huge-page backed allocation for the large randomly accessed arrays of cooccur and glove
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef _HUGEPAGE_H_
+#define _HUGEPAGE_H_
+
+#include <stddef.h>
+
+/* Values of the -hugepages option */
+#define HUGEPAGE_OFF 0        // plain anonymous mapping
+#define HUGEPAGE_THP 1        // transparent huge pages, madvise(MADV_HUGEPAGE)
+#define HUGEPAGE_EXPLICIT 2   // MAP_HUGETLB from the reserved pool, falling back to transparent huge pages
+
+/* Allocate a zero-filled, page-aligned region of at least bytes, backed by huge pages as far as mode and the system allow.
+ * With threads > 0 the pages are faulted in up front by that many threads; with threads <= 0 they are left to fault on
+ * first touch, which suits buffers that are filled sequentially. With verbose > 0 the page size actually obtained is reported,
+ * labelled with what. Returns NULL if no memory could be mapped at all. */
+void *huge_alloc(size_t bytes, int mode, int threads, const char *what, int verbose);
+
+/* Release a region from huge_alloc; bytes must be the size passed to huge_alloc */
+void huge_free(void *p, size_t bytes);
+
+#endif
@@ -0,0 +1,98 @@
+//  Open-addressing map from numeric token ids to insertion indices, the -int-tokens counterpart of the string table
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdlib.h>
+#include "id_map.h"
+
+#define IM_MIN_SLOTS 1024
+
+static IMENT *alloc_slots(long long n) {
+    IMENT *slots = malloc(sizeof(IMENT) * n);
+    long long i;
+    if (slots == NULL) return NULL;
+    for (i = 0; i < n; i++) slots[i].idx = IM_EMPTY;
+    return slots;
+}
+
+IDMAP *idmap_create(long long expected) {
+    IDMAP *m = malloc(sizeof(IDMAP));
+    long long n = IM_MIN_SLOTS;
+    if (m == NULL) return NULL;
+    while (n * 2 < expected * 3) n <<= 1; // keep the load factor below 2/3
+    m->slots = alloc_slots(n);
+    m->mask = n - 1;
+    m->size = 0;
+    m->ids_cap = n;
+    m->ids = malloc(sizeof(unsigned long long) * m->ids_cap);
+    if (m->slots == NULL || m->ids == NULL) {
+        idmap_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void idmap_free(IDMAP *m) {
+    if (m == NULL) return;
+    free(m->slots);
+    free(m->ids);
+    free(m);
+}
+
+static int grow(IDMAP *m) {
+    long long n = (m->mask + 1) << 1, i, pos;
+    IMENT *slots = alloc_slots(n);
+    if (slots == NULL) return 1;
+    for (i = 0; i <= m->mask; i++) {
+        if (m->slots[i].idx == IM_EMPTY) continue;
+        for (pos = idmap_hash(m->slots[i].id) & (n - 1); slots[pos].idx != IM_EMPTY; pos = (pos + 1) & (n - 1));
+        slots[pos] = m->slots[i];
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->mask = n - 1;
+    return 0;
+}
+
+long long idmap_find(const IDMAP *m, unsigned long long id, unsigned long long h) {
+    long long pos;
+    for (pos = h & m->mask; m->slots[pos].idx != IM_EMPTY; pos = (pos + 1) & m->mask)
+        if (m->slots[pos].id == id) return m->slots[pos].idx;
+    return -1;
+}
+
+long long idmap_insert(IDMAP *m, unsigned long long id, unsigned long long h, int *inserted) {
+    long long pos, idx;
+    for (pos = h & m->mask; m->slots[pos].idx != IM_EMPTY; pos = (pos + 1) & m->mask) {
+        if (m->slots[pos].id == id) {
+            if (inserted) *inserted = 0;
+            return m->slots[pos].idx;
+        }
+    }
+    if (inserted) *inserted = 1;
+    if ((m->size + 1) * 3 > (m->mask + 1) * 2) {
+        if (grow(m)) return -1;
+        for (pos = h & m->mask; m->slots[pos].idx != IM_EMPTY; pos = (pos + 1) & m->mask);
+    }
+    if (m->size == m->ids_cap) {
+        unsigned long long *ids = realloc(m->ids, sizeof(unsigned long long) * m->ids_cap * 2);
+        if (ids == NULL) return -1;
+        m->ids = ids;
+        m->ids_cap *= 2;
+    }
+    idx = m->size++;
+    m->ids[idx] = id;
+    m->slots[pos].id = id;
+    m->slots[pos].idx = (unsigned int)idx;
+    return idx;
+}
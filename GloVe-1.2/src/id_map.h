@@ -0,0 +1,67 @@
+//  Open-addressing map from numeric token ids to insertion indices, the -int-tokens counterpart of the string table
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef _ID_MAP_H_
+#define _ID_MAP_H_
+
+/* One slot of the map. The id is the key itself, so a probe compares one integer and never touches a string. */
+typedef struct id_map_entry {
+    unsigned long long id;
+    unsigned int idx;      // insertion index, IM_EMPTY for a free slot
+} IMENT;
+
+#define IM_EMPTY 0xffffffffu
+
+typedef struct id_map {
+    IMENT *slots;
+    long long mask;        // number of slots - 1, always a power of two minus one
+    long long size;        // number of ids
+    unsigned long long *ids; // id of each insertion index
+    long long ids_cap;
+} IDMAP;
+
+/* Murmur3 finalizer of id */
+static inline unsigned long long idmap_hash(unsigned long long id) {
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    id *= 0xc4ceb9fe1a85ec53ULL;
+    return id ^ (id >> 33);
+}
+
+/* Parse w[0..len) as a token id. Only the canonical decimal form counts (no sign, no leading zero, at most
+ * 2^64 - 1), so that printing the id back gives the same token; returns 0 for anything else. */
+static inline int idmap_parse(const char *w, int len, unsigned long long *id) {
+    unsigned long long v = 0, d;
+    int i;
+    if (len < 1 || len > 20 || (w[0] == '0' && len > 1)) return 0;
+    for (i = 0; i < len; i++) {
+        d = (unsigned char)w[i] - '0';
+        if (d > 9 || v > (0xffffffffffffffffULL - d) / 10) return 0;
+        v = v * 10 + d;
+    }
+    *id = v;
+    return 1;
+}
+
+IDMAP *idmap_create(long long expected);
+void idmap_free(IDMAP *m);
+
+/* Return the insertion index of id, or -1 if it is absent; h must be idmap_hash(id) */
+long long idmap_find(const IDMAP *m, unsigned long long id, unsigned long long h);
+
+/* Return the insertion index of id, adding it first if it is absent; *inserted (if not NULL) tells which. -1 when out of memory. */
+long long idmap_insert(IDMAP *m, unsigned long long id, unsigned long long h, int *inserted);
+
+#endif
@@ -0,0 +1,101 @@
+//  Hash map from word pairs to accumulated counts, used to aggregate cooccur partitions and segment vocabularies
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdlib.h>
+#include "pair_map.h"
+
+#define PM_MIN_SLOTS 1024
+
+static inline unsigned long long pm_hash(unsigned long long k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    return k ^ (k >> 33);
+}
+
+PAIRMAP *pairmap_create(long long expected) {
+    PAIRMAP *m = malloc(sizeof(PAIRMAP));
+    long long n = PM_MIN_SLOTS;
+    if (m == NULL) return NULL;
+    while (n * 2 < expected * 3) n <<= 1; // keep the load factor below 2/3
+    m->slots = calloc(n, sizeof(PMENT));
+    if (m->slots == NULL) {
+        free(m);
+        return NULL;
+    }
+    m->mask = n - 1;
+    m->size = 0;
+    return m;
+}
+
+void pairmap_free(PAIRMAP *m) {
+    if (m == NULL) return;
+    free(m->slots);
+    free(m);
+}
+
+static int grow(PAIRMAP *m) {
+    long long n = (m->mask + 1) << 1, i, pos;
+    PMENT *slots = calloc(n, sizeof(PMENT));
+    if (slots == NULL) return 1;
+    for (i = 0; i <= m->mask; i++) {
+        if (m->slots[i].key == 0) continue;
+        for (pos = pm_hash(m->slots[i].key) & (n - 1); slots[pos].key != 0; pos = (pos + 1) & (n - 1));
+        slots[pos] = m->slots[i];
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->mask = n - 1;
+    return 0;
+}
+
+int pairmap_add(PAIRMAP *m, int word1, int word2, double val) {
+    unsigned long long key = ((unsigned long long)(unsigned int)word1 << 32) | (unsigned int)word2;
+    long long pos;
+    for (pos = pm_hash(key) & m->mask; m->slots[pos].key != 0; pos = (pos + 1) & m->mask) {
+        if (m->slots[pos].key == key) {
+            m->slots[pos].val += val;
+            return 0;
+        }
+    }
+    if ((m->size + 1) * 3 > (m->mask + 1) * 2) {
+        if (grow(m)) return 1;
+        for (pos = pm_hash(key) & m->mask; m->slots[pos].key != 0; pos = (pos + 1) & m->mask);
+    }
+    m->slots[pos].key = key;
+    m->slots[pos].val = val;
+    m->size++;
+    return 0;
+}
+
+PMENT *pairmap_find(PAIRMAP *m, int word1, int word2) {
+    unsigned long long key = ((unsigned long long)(unsigned int)word1 << 32) | (unsigned int)word2;
+    long long pos;
+    for (pos = pm_hash(key) & m->mask; m->slots[pos].key != 0; pos = (pos + 1) & m->mask)
+        if (m->slots[pos].key == key) return &m->slots[pos];
+    return NULL;
+}
+
+static int compare_key(const void *a, const void *b) {
+    unsigned long long x = ((const PMENT *)a)->key, y = ((const PMENT *)b)->key;
+    return (x > y) - (x < y);
+}
+
+long long pairmap_sort(PAIRMAP *m) {
+    long long i, n = 0;
+    for (i = 0; i <= m->mask; i++) if (m->slots[i].key != 0) m->slots[n++] = m->slots[i];
+    qsort(m->slots, n, sizeof(PMENT), compare_key);
+    return n;
+}
@@ -0,0 +1,47 @@
+//  Hash map from word pairs to accumulated counts, used to aggregate cooccur partitions and segment vocabularies
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef _PAIR_MAP_H_
+#define _PAIR_MAP_H_
+
+/* Open-addressing map from (word1, word2), both > 0, to a summed value. The key packs word1 into the high half,
+ * so sorting by key orders the pairs by (word1, word2); key 0 marks a free slot. */
+typedef struct pair_map_entry {
+    unsigned long long key;
+    double val;
+} PMENT;
+
+typedef struct pair_map {
+    PMENT *slots;
+    long long mask;        // number of slots - 1
+    long long size;        // number of distinct pairs
+} PAIRMAP;
+
+PAIRMAP *pairmap_create(long long expected);
+void pairmap_free(PAIRMAP *m);
+
+/* Add val to the entry of (word1, word2), creating it if needed; returns 1 if out of memory */
+int pairmap_add(PAIRMAP *m, int word1, int word2, double val);
+
+/* Return the entry of (word1, word2), or NULL if there is none */
+PMENT *pairmap_find(PAIRMAP *m, int word1, int word2);
+
+/* Move the entries to the front of slots, sorted by (word1, word2), and return their number; the map is no longer
+ * usable for lookups afterwards */
+long long pairmap_sort(PAIRMAP *m);
+
+static inline int pairmap_word1(const PMENT *e) { return (int)(e->key >> 32); }
+static inline int pairmap_word2(const PMENT *e) { return (int)(e->key & 0xffffffffULL); }
+
+#endif
@@ -0,0 +1,147 @@
+//  Block-encoded sorted runs of cooccurrence records, used for the cooccur temp files
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include "spill_run.h"
+
+static inline unsigned char *put_varint(unsigned char *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static inline const unsigned char *get_varint(const unsigned char *p, unsigned long long *v) {
+    unsigned long long x = *p & 0x7f;
+    int shift = 7;
+    while (*p++ & 0x80) {
+        x |= (unsigned long long)(*p & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = x;
+    return p;
+}
+
+RUNWRITER *run_writer_open(FILE *f, int int_vals) {
+    RUNWRITER *w = malloc(sizeof(RUNWRITER));
+    if (w == NULL) return NULL;
+    w->buf = malloc(RUN_BLOCK_RECS * RUN_MAX_REC_BYTES);
+    if (w->buf == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->f = f;
+    w->int_vals = int_vals;
+    w->len = w->n = 0;
+    return w;
+}
+
+static int flush_block(RUNWRITER *w) {
+    unsigned int header[2];
+    if (w->n == 0) return 0;
+    header[0] = w->n;
+    header[1] = w->len;
+    if (fwrite(header, sizeof(header), 1, w->f) != 1 || fwrite(w->buf, w->len, 1, w->f) != 1) return 1;
+    w->len = w->n = 0;
+    return 0;
+}
+
+int run_write(RUNWRITER *w, int word1, int word2, double val) {
+    unsigned char *p = w->buf + w->len;
+    unsigned int d1 = (unsigned int)word1 - (w->n ? w->last1 : 0); // 32-bit wraparound keeps an out-of-order record decodable
+    p = put_varint(p, d1);
+    p = put_varint(p, (d1 == 0 && w->n) ? (unsigned int)word2 - w->last2 : (unsigned int)word2);
+    if (w->int_vals) p = put_varint(p, (unsigned int)val);
+    else if (val >= 0 && val < 4611686018427387904.0 && val == (double)(unsigned long long)val) p = put_varint(p, (unsigned long long)val << 1);
+    else {
+        *p++ = 1;
+        memcpy(p, &val, sizeof(double));
+        p += sizeof(double);
+    }
+    w->len = p - w->buf;
+    w->last1 = word1;
+    w->last2 = word2;
+    if (++w->n == RUN_BLOCK_RECS) return flush_block(w);
+    return 0;
+}
+
+int run_writer_close(RUNWRITER *w) {
+    int err;
+    if (w == NULL) return 1;
+    err = flush_block(w);
+    free(w->buf);
+    free(w);
+    return err;
+}
+
+RUNREADER *run_reader_open(FILE *f, int int_vals) {
+    RUNREADER *r = calloc(1, sizeof(RUNREADER));
+    if (r == NULL) return NULL;
+    r->f = f;
+    r->int_vals = int_vals;
+    r->buf = malloc(RUN_BLOCK_RECS * RUN_MAX_REC_BYTES + 8); // slack so a corrupt final varint cannot read past the end
+    r->word1 = malloc(sizeof(int) * RUN_BLOCK_RECS);
+    r->word2 = malloc(sizeof(int) * RUN_BLOCK_RECS);
+    r->val = malloc(sizeof(double) * RUN_BLOCK_RECS);
+    if (r->buf == NULL || r->word1 == NULL || r->word2 == NULL || r->val == NULL) {
+        run_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void run_reader_close(RUNREADER *r) {
+    if (r == NULL) return;
+    free(r->buf);
+    free(r->word1);
+    free(r->word2);
+    free(r->val);
+    free(r);
+}
+
+int run_next_block(RUNREADER *r) {
+    unsigned int header[2], w1 = 0, w2 = 0;
+    unsigned long long v;
+    const unsigned char *p;
+    int i;
+    r->n = r->pos = 0;
+    if (fread(header, sizeof(header), 1, r->f) != 1) return 0;
+    if (header[0] == 0 || header[0] > RUN_BLOCK_RECS || header[1] > RUN_BLOCK_RECS * RUN_MAX_REC_BYTES) return 0;
+    if (fread(r->buf, header[1], 1, r->f) != 1) return 0;
+    memset(r->buf + header[1], 0, 8);
+    p = r->buf;
+    for (i = 0; i < (int)header[0]; i++) {
+        p = get_varint(p, &v);
+        if (v != 0 || i == 0) { // new word1, word2 follows in full
+            w1 += (unsigned int)v;
+            w2 = 0;
+        }
+        p = get_varint(p, &v);
+        w2 += (unsigned int)v;
+        r->word1[i] = (int)w1;
+        r->word2[i] = (int)w2;
+        p = get_varint(p, &v);
+        if (r->int_vals) r->val[i] = (double)v;
+        else if (v & 1) {
+            memcpy(&r->val[i], p, sizeof(double));
+            p += sizeof(double);
+        }
+        else r->val[i] = (double)(v >> 1);
+    }
+    r->n = header[0];
+    return 1;
+}
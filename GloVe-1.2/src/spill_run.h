@@ -0,0 +1,66 @@
+//  Block-encoded sorted runs of cooccurrence records, used for the cooccur temp files
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef _SPILL_RUN_H_
+#define _SPILL_RUN_H_
+
+#include <stdio.h>
+
+/* A run is a sequence of blocks of up to RUN_BLOCK_RECS records, each block a header (record count, payload bytes)
+ * followed by varints: the word1 delta, word2 as a delta within the same word1 and absolute otherwise, then the value.
+ * Integer values are plain varints; real values are varint(v << 1) when they hold a whole number v, otherwise a 1
+ * followed by the 8 raw bytes of the double. Records are expected sorted by (word1, word2), which keeps the deltas small. */
+#define RUN_BLOCK_RECS 4096
+#define RUN_MAX_REC_BYTES 19 // two 5-byte word varints and a flagged 8-byte double
+
+typedef struct run_writer {
+    FILE *f;
+    int int_vals;               // values are unsigned 32-bit counts
+    unsigned char *buf;         // payload of the current block
+    int len;                    // payload bytes in buf
+    int n;                      // records in the current block
+    unsigned int last1, last2;  // previous record of the block
+} RUNWRITER;
+
+typedef struct run_reader {
+    FILE *f;
+    int int_vals;
+    unsigned char *buf;         // payload of the current block
+    int *word1, *word2;         // the current block, decoded
+    double *val;
+    int n, pos;                 // decoded records and next one to hand out
+} RUNREADER;
+
+/* Writer appending to an open file; run_writer_close flushes the last block but leaves the file open. Return 1 on failure. */
+RUNWRITER *run_writer_open(FILE *f, int int_vals);
+int run_write(RUNWRITER *w, int word1, int word2, double val);
+int run_writer_close(RUNWRITER *w);
+
+RUNREADER *run_reader_open(FILE *f, int int_vals);
+void run_reader_close(RUNREADER *r);
+
+/* Decode the next block; returns 0 at end of run */
+int run_next_block(RUNREADER *r);
+
+/* Next record of the run, return 0 at end of run */
+static inline int run_read(RUNREADER *r, int *word1, int *word2, double *val) {
+    if (r->pos == r->n && !run_next_block(r)) return 0;
+    *word1 = r->word1[r->pos];
+    *word2 = r->word2[r->pos];
+    *val = r->val[r->pos];
+    r->pos++;
+    return 1;
+}
+
+#endif
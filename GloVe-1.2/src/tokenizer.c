@@ -0,0 +1,155 @@
+//  Block tokenizer shared by vocab_count and cooccur
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "tokenizer.h"
+
+#define MAX_WORD_LENGTH (MAX_STRING_LENGTH - 2) // longest word kept by the original get_word()
+
+static inline int is_delim(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Find first ' ', '\t', '\n' or '\r' in [p, end), return end if there is none */
+static char *find_delim(char *p, char *end) {
+#if defined(__AVX2__)
+    const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+    const __m256i nl = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+        const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+        while (end - p >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+            if (mask) return p + __builtin_ctz(mask);
+            p += 16;
+        }
+    }
+#endif
+    while (p < end && !is_delim(*p)) p++;
+    return p;
+}
+
+/* Move the unfinished word starting at keep_from to the front of the buffer and read the next block behind it.
+ * Returns the number of new bytes, 0 at end of input. */
+static long long refill(TOKENIZER *tk, long long keep_from) {
+    long long keep = tk->end - keep_from, n;
+    if (keep > MAX_WORD_LENGTH) keep = MAX_WORD_LENGTH; // the rest of an overlong word is dropped anyway
+    if (keep > 0) memmove(tk->buf, tk->buf + keep_from, keep);
+    tk->pos = 0;
+    tk->end = keep;
+    if (tk->eof) return 0;
+    do n = read(tk->fd, tk->buf + keep, TOKEN_BLOCK_SIZE - keep);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        tk->eof = 1;
+        return 0;
+    }
+    tk->end += n;
+    return n;
+}
+
+TOKENIZER *tokenizer_open(FILE *fin) {
+    TOKENIZER *tk = malloc(sizeof(TOKENIZER));
+    if (tk == NULL) return NULL;
+    tk->buf = malloc(TOKEN_BLOCK_SIZE + 1);
+    if (tk->buf == NULL) {
+        free(tk);
+        return NULL;
+    }
+    tk->fd = fileno(fin);
+    tk->pos = tk->end = 0;
+    tk->eof = 0;
+    tk->pending_newline = 0;
+    return tk;
+}
+
+void tokenizer_close(TOKENIZER *tk) {
+    if (tk == NULL) return;
+    free(tk->buf);
+    free(tk);
+}
+
+int get_token(TOKENIZER *tk, char **word, int *len) {
+    char *buf, *q;
+    long long start, scan, n;
+
+    if (tk->pending_newline) {
+        tk->pending_newline = 0;
+        return TOKEN_NEWLINE;
+    }
+
+    /* Skip blanks; '\r' is dropped just like the blanks */
+    for (;;) {
+        buf = tk->buf;
+        while (tk->pos < tk->end && (buf[tk->pos] == ' ' || buf[tk->pos] == '\t' || buf[tk->pos] == '\r')) tk->pos++;
+        if (tk->pos < tk->end) break;
+        if (refill(tk, tk->end) == 0) return TOKEN_EOF;
+    }
+    if (buf[tk->pos] == '\n') {
+        tk->pos++;
+        return TOKEN_NEWLINE;
+    }
+
+    start = scan = tk->pos;
+    for (;;) {
+        q = find_delim(buf + scan, buf + tk->end);
+        if (q < buf + tk->end) {
+            if (*q != '\r') break;
+            /* Drop an embedded '\r' by shifting the word prefix over it, unless it lies past the truncation point */
+            if (q - (buf + start) < MAX_WORD_LENGTH) {
+                memmove(buf + start + 1, buf + start, q - (buf + start));
+                start++;
+            }
+            scan = q + 1 - buf;
+            continue;
+        }
+        /* Word runs into the end of the block */
+        n = tk->end - start;
+        if (n > MAX_WORD_LENGTH) n = MAX_WORD_LENGTH;
+        if (refill(tk, start) == 0) {
+            q = buf + tk->end; // last word of the input, no delimiter behind it
+            start = 0;
+            break;
+        }
+        start = 0;
+        scan = n;
+    }
+
+    if (q < buf + tk->end && *q == '\n') tk->pending_newline = 1;
+    *len = (int)(q - (buf + start));
+    if (*len > MAX_WORD_LENGTH) *len = MAX_WORD_LENGTH;
+    buf[start + *len] = 0;
+    *word = buf + start;
+    tk->pos = (q < buf + tk->end) ? q + 1 - buf : tk->end;
+    return TOKEN_WORD;
+}
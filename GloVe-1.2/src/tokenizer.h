@@ -0,0 +1,46 @@
+//  Block tokenizer shared by vocab_count and cooccur
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef _TOKENIZER_H_
+#define _TOKENIZER_H_
+
+#include <stdio.h>
+
+#define MAX_STRING_LENGTH 1000
+#define TOKEN_BLOCK_SIZE (4 << 20) // bytes read from the input per refill
+
+/* Return codes of get_token() */
+#define TOKEN_WORD 0
+#define TOKEN_NEWLINE 1
+#define TOKEN_EOF -1
+
+typedef struct tokenizer {
+    int fd;
+    char *buf;          // block buffer, TOKEN_BLOCK_SIZE + 1 bytes; a carried-over partial word is part of the block
+    long long pos;      // next unread byte in buf
+    long long end;      // one past the last valid byte in buf
+    int eof;            // underlying fd is exhausted
+    int pending_newline; // last word was terminated by '\n', report it on the next call
+} TOKENIZER;
+
+/* Create a tokenizer reading from an open stream; the stream must not be read through stdio afterwards */
+TOKENIZER *tokenizer_open(FILE *fin);
+void tokenizer_close(TOKENIZER *tk);
+
+/* Fetch the next token. On TOKEN_WORD, *word points into the block buffer (NUL-terminated, valid until the next call) and *len is its length.
+ * Semantics match the original fgetc-based get_word(): ' ', '\t' and '\n' separate words, '\r' is dropped wherever it occurs,
+ * words are truncated to MAX_STRING_LENGTH - 2 bytes, and every '\n' is reported as a separate TOKEN_NEWLINE. */
+int get_token(TOKENIZER *tk, char **word, int *len);
+
+#endif
@@ -25,26 +25,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define MAX_STRING_LENGTH 1000
-#define TSIZE	1048576
-#define SEED	1159241
-#define HASHFN  bitwisehash
+#include "tokenizer.h"
+#include "vocab_hash.h"
+#include "id_map.h"
+#include "pair_map.h"
 
 typedef struct vocabulary {
     char *word;
     long long count;
+    unsigned int bucket;
 } VOCAB;
 
-typedef struct hashrec {
-    char *word;
-    long long count;
-    struct hashrec *next;
-} HASHREC;
-
 int verbose = 2; // 0, 1, or 2
 long long min_count = 1; // min occurrences for inclusion in vocab
 long long max_vocab = 0; // max_vocab = 0 for no limit
+int session = 0; // 1: lines are sessions, count each word at most once per line
+int segments = 0; // 1: the first token of each line is a segment key, count and write a vocabulary per segment
+int weighted = 0; // 1: the first token of each line is its multiplicity, as written by dedup
+int int_tokens = 0; // 1: words are numeric ids, counted in an id map without keeping their strings
+long long non_ids = 0; // -int-tokens: tokens that are not ids, skipped
 
 
 /* Efficient string comparison */
@@ -54,6 +53,29 @@ int scmp( char *s1, char *s2 ) {
 }
 
 
+/* Multiplicity token of a -weighted line, 0 if malformed so that the line counts nothing */
+long long parse_weight(char *word) {
+    char *end;
+    long long w = strtoll(word, &end, 10);
+    return (*end == '\0' && w > 0) ? w : 0;
+}
+
+/* Index of a word, interning it if it is new: in the string table, or with -int-tokens 1 in the id map.
+ * -1 if out of memory, -2 if the token is not an id and is skipped. */
+long long intern_word(VOCABHASH *vocab_hash, IDMAP *id_map, char *word, int len) {
+    unsigned long long id;
+    if(!int_tokens) return vocabhash_insert(vocab_hash, word, len, vocabhash_hash(word, len), NULL);
+    if(!idmap_parse(word, len, &id)) {non_ids++; return -2;}
+    return idmap_insert(id_map, id, idmap_hash(id), NULL);
+}
+
+/* Text of word idx for the output: its interned string, or with -int-tokens 1 its id printed into buf (21 bytes) */
+char *word_text(VOCABHASH *vocab_hash, IDMAP *id_map, long long idx, char *buf) {
+    if(!int_tokens) return vocabhash_word(vocab_hash, idx);
+    sprintf(buf, "%llu", id_map->ids[idx]);
+    return buf;
+}
+
 /* Vocab frequency comparison; break ties alphabetically */
 int CompareVocabTie(const void *a, const void *b) {
     long long c;
@@ -62,16 +84,15 @@ int CompareVocabTie(const void *a, const void *b) {
     
 }
 
-/* Vocab frequency comparison; no tie-breaker */
+/* Vocab frequency comparison; ties keep the pseudo-random order of the old hash buckets */
 int CompareVocab(const void *a, const void *b) {
     long long c;
     if( (c = ((VOCAB *) b)->count - ((VOCAB *) a)->count) != 0) return ( c > 0 ? 1 : -1 );
-    else return 0;
+    else return ( ((VOCAB *) a)->bucket > ((VOCAB *) b)->bucket ) - ( ((VOCAB *) a)->bucket < ((VOCAB *) b)->bucket );
 }
 
-/* Move-to-front hashing and hash function from Hugh Williams, http://www.seg.rmit.edu.au/code/zwh-ipl/ */
-
-/* Simple bitwise hash function */
+/* Simple bitwise hash function from Hugh Williams, http://www.seg.rmit.edu.au/code/zwh-ipl/
+ * No longer used for lookups; it only orders equal-count words before truncation, as the old 1M-bucket table did */
 unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
     char c;
     unsigned int h;
@@ -80,94 +101,220 @@ unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
     return((unsigned int)((h&0x7fffffff) % tsize));
 }
 
-/* Create hash table, initialise pointers to NULL */
-HASHREC ** inithashtable() {
-    int	i;
-    HASHREC **ht;
-    ht = (HASHREC **) malloc( sizeof(HASHREC *) * TSIZE );
-    for(i = 0; i < TSIZE; i++) ht[i] = (HASHREC *) NULL;
-    return(ht);
-}
-
-/* Search hash table for given string, insert if not found */
-void hashinsert(HASHREC **ht, char *w) {
-    HASHREC	*htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
+/* Sort n counted words and print those within -max-vocab and -min-count, each line prefixed by segment unless it is NULL;
+ * returns the number of words printed */
+long long write_vocab(VOCAB *vocab, long long n, const char *segment) {
+    long long i, limit = max_vocab;
+    if(limit > 0 && limit < n)
+        // If the vocabulary exceeds limit, first sort full vocab by frequency without alphabetical tie-breaks.
+        // This results in pseudo-random ordering for words with same frequency, so that when truncated, the words span whole alphabet
+        qsort(vocab, n, sizeof(VOCAB), CompareVocab);
+    else limit = n;
+    qsort(vocab, limit, sizeof(VOCAB), CompareVocabTie); //After (possibly) truncating, sort (possibly again), breaking ties alphabetically
     
-    for(hprv = NULL, htmp = ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if(htmp == NULL) {
-        htmp = (HASHREC *) malloc( sizeof(HASHREC) );
-        htmp->word = (char *) malloc( strlen(w) + 1 );
-        strcpy(htmp->word, w);
-        htmp->count = 1;
-        htmp->next = NULL;
-        if( hprv==NULL )
-            ht[hval] = htmp;
-        else
-            hprv->next = htmp;
-    }
-    else {
-        /* new records are not moved to front */
-        htmp->count++;
-        if(hprv != NULL) {
-            /* move to front on access */
-            hprv->next = htmp->next;
-            htmp->next = ht[hval];
-            ht[hval] = htmp;
+    for(i = 0; i < limit; i++) {
+        if(vocab[i].count < min_count) { // If a minimum frequency cutoff exists, truncate vocabulary
+            if(verbose > 0 && segment == NULL) fprintf(stderr, "Truncating vocabulary at min count %lld.\n",min_count);
+            break;
         }
+        if(segment != NULL) printf("%s %s %lld\n",segment,vocab[i].word,vocab[i].count);
+        else printf("%s %lld\n",vocab[i].word,vocab[i].count);
     }
-    return;
+    
+    if(i == limit && limit < n) if(verbose > 0 && segment == NULL) fprintf(stderr, "Truncating vocabulary at size %lld.\n", limit);
+    return i;
 }
 
 int get_counts() {
-    long long i = 0, j = 0, vocab_size = 12500;
-    char format[20];
-    char str[MAX_STRING_LENGTH + 1];
-    HASHREC **vocab_hash = inithashtable();
-    HASHREC *htmp;
+    long long i = 0, j = 0, idx, counts_size = 1048576, line = 1, weight = 1;
+    char *word;
+    int len, flag, weight_next = weighted;
+    VOCABHASH *vocab_hash = int_tokens ? NULL : vocabhash_create(counts_size);
+    IDMAP *id_map = int_tokens ? idmap_create(counts_size) : NULL;
+    char *text = NULL; // -int-tokens: the ids printed for sorting and output, 21 bytes each
+    long long *counts = calloc(counts_size, sizeof(long long)), *tmp;
+    long long *last_line = session ? calloc(counts_size, sizeof(long long)) : NULL; // line on which each word was last counted
     VOCAB *vocab;
-    FILE *fid = stdin;
+    TOKENIZER *tk = tokenizer_open(stdin);
     
     fprintf(stderr, "BUILDING VOCABULARY\n");
     if(verbose > 1) fprintf(stderr, "Processed %lld tokens.", i);
-    sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-    while(fscanf(fid, format, str) != EOF) { // Insert all tokens into hashtable
-        hashinsert(vocab_hash, str);
-        if(((++i)%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[11G%lld tokens.", i);
+    if (tk == NULL || (vocab_hash == NULL && id_map == NULL) || counts == NULL || (session && last_line == NULL)) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
     }
-    if(verbose > 1) fprintf(stderr, "\033[0GProcessed %lld tokens.\n", i);
-    vocab = malloc(sizeof(VOCAB) * vocab_size);
-    for(i = 0; i < TSIZE; i++) { // Migrate vocab to array
-        htmp = vocab_hash[i];
-        while (htmp != NULL) {
-            vocab[j].word = htmp->word;
-            vocab[j].count = htmp->count;
-            j++;
-            if(j>=vocab_size) {
-                vocab_size += 2500;
-                vocab = (VOCAB *)realloc(vocab, sizeof(VOCAB) * vocab_size);
+    while((flag = get_token(tk, &word, &len)) != TOKEN_EOF) { // Insert all tokens into hashtable
+        if(flag == TOKEN_NEWLINE) {line++; weight_next = weighted; continue;}
+        if(weight_next) {weight = parse_weight(word); weight_next = 0; continue;}
+        if(weight == 0) continue;
+        idx = intern_word(vocab_hash, id_map, word, len);
+        if (idx == -2) continue;
+        if (idx < 0) {
+            fprintf(stderr, "Couldn't allocate memory!");
+            return 1;
+        }
+        if (idx >= counts_size) {
+            tmp = realloc(counts, sizeof(long long) * counts_size * 2);
+            if (tmp == NULL) {
+                fprintf(stderr, "Couldn't allocate memory!");
+                return 1;
+            }
+            memset(tmp + counts_size, 0, sizeof(long long) * counts_size);
+            counts = tmp;
+            if (session) {
+                if ((tmp = realloc(last_line, sizeof(long long) * counts_size * 2)) == NULL) {
+                    fprintf(stderr, "Couldn't allocate memory!");
+                    return 1;
+                }
+                memset(tmp + counts_size, 0, sizeof(long long) * counts_size);
+                last_line = tmp;
             }
-            htmp = htmp->next;
+            counts_size *= 2;
         }
+        if (!session) counts[idx] += weight;
+        else if (last_line[idx] != line) { // Not yet counted in this session
+            last_line[idx] = line;
+            counts[idx] += weight;
+        }
+        if(((++i)%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[11G%lld tokens.", i);
+    }
+    tokenizer_close(tk);
+    if(verbose > 1) fprintf(stderr, "\033[0GProcessed %lld tokens.\n", i);
+    if(non_ids > 0) fprintf(stderr, "Skipped %lld tokens that are not ids.\n", non_ids);
+    j = int_tokens ? id_map->size : vocab_hash->size;
+    vocab = malloc(sizeof(VOCAB) * (j + 1));
+    if (int_tokens) text = malloc(21 * (j + 1));
+    if (vocab == NULL || (int_tokens && text == NULL)) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    for(i = 0; i < j; i++) { // Migrate vocab to array
+        vocab[i].word = word_text(vocab_hash, id_map, i, text + 21 * i);
+        vocab[i].count = counts[i];
+        vocab[i].bucket = bitwisehash(vocab[i].word, 1048576, 1159241);
     }
+    free(counts);
+    free(last_line);
     if(verbose > 1) fprintf(stderr, "Counted %lld unique words.\n", j);
-    if(max_vocab > 0 && max_vocab < j)
-        // If the vocabulary exceeds limit, first sort full vocab by frequency without alphabetical tie-breaks.
-        // This results in pseudo-random ordering for words with same frequency, so that when truncated, the words span whole alphabet
-        qsort(vocab, j, sizeof(VOCAB), CompareVocab);
-    else max_vocab = j;
-    qsort(vocab, max_vocab, sizeof(VOCAB), CompareVocabTie); //After (possibly) truncating, sort (possibly again), breaking ties alphabetically
+    i = write_vocab(vocab, j, NULL);
+    fprintf(stderr, "Using vocabulary of size %lld.\n\n", i);
+    free(text);
+    return 0;
+}
+
+VOCABHASH *segment_hash; // segment keys, for ordering the segments
+long long *segment_total; // tokens of each segment
+
+/* Larger segments first, then by key */
+int CompareSegment(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    if(segment_total[x] != segment_total[y]) return segment_total[x] < segment_total[y] ? 1 : -1;
+    return strcmp(vocabhash_word(segment_hash, x), vocabhash_word(segment_hash, y));
+}
+
+/* -segments 1: one vocabulary per segment. Words and segment keys are interned once for all segments; the counts are
+ * kept per (segment, word) in a pair map. Segments are written largest first, as lines "segment word count". */
+int get_segment_counts() {
+    long long i = 0, j, n, idx, seg = -1, nseg, line = 1, entries, total_cap = 1024, last_cap = 1048576, words = 0, weight = 1;
+    long long *order, *start, *tmp;
+    char *word;
+    int len, flag, first = 1, inserted, weight_next = weighted;
+    VOCABHASH *vocab_hash = int_tokens ? NULL : vocabhash_create(1048576);
+    IDMAP *id_map = int_tokens ? idmap_create(1048576) : NULL;
+    char *text = NULL; // -int-tokens: the ids of a segment printed for sorting and output, 21 bytes each
+    PAIRMAP *counts = pairmap_create(1048576);
+    long long *last_line = session ? calloc(last_cap, sizeof(long long)) : NULL; // line on which each word was last counted
+    VOCAB *vocab;
+    TOKENIZER *tk = tokenizer_open(stdin);
     
-    for(i = 0; i < max_vocab; i++) {
-        if(vocab[i].count < min_count) { // If a minimum frequency cutoff exists, truncate vocabulary
-            if(verbose > 0) fprintf(stderr, "Truncating vocabulary at min count %lld.\n",min_count);
-            break;
+    segment_hash = vocabhash_create(1024);
+    segment_total = calloc(total_cap, sizeof(long long));
+    fprintf(stderr, "BUILDING SEGMENT VOCABULARIES\n");
+    if(verbose > 1) fprintf(stderr, "Processed %lld tokens.", i);
+    if (tk == NULL || (vocab_hash == NULL && id_map == NULL) || counts == NULL || segment_hash == NULL || segment_total == NULL || (session && last_line == NULL)) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    while((flag = get_token(tk, &word, &len)) != TOKEN_EOF) {
+        if(flag == TOKEN_NEWLINE) {line++; first = 1; weight_next = weighted; continue;}
+        if(weight_next) {weight = parse_weight(word); weight_next = 0; continue;}
+        if(weight == 0) continue;
+        if(first) { // Segment key
+            first = 0;
+            seg = vocabhash_insert(segment_hash, word, len, vocabhash_hash(word, len), &inserted);
+            if (seg < 0) {
+                fprintf(stderr, "Couldn't allocate memory!");
+                return 1;
+            }
+            if (seg >= total_cap) {
+                if ((tmp = realloc(segment_total, sizeof(long long) * total_cap * 2)) == NULL) {
+                    fprintf(stderr, "Couldn't allocate memory!");
+                    return 1;
+                }
+                memset(tmp + total_cap, 0, sizeof(long long) * total_cap);
+                segment_total = tmp;
+                total_cap *= 2;
+            }
+            continue;
+        }
+        idx = intern_word(vocab_hash, id_map, word, len);
+        if (idx == -2) continue;
+        if (idx < 0) {
+            fprintf(stderr, "Couldn't allocate memory!");
+            return 1;
+        }
+        if (session) {
+            if (idx >= last_cap) {
+                if ((tmp = realloc(last_line, sizeof(long long) * last_cap * 2)) == NULL) {
+                    fprintf(stderr, "Couldn't allocate memory!");
+                    return 1;
+                }
+                memset(tmp + last_cap, 0, sizeof(long long) * last_cap);
+                last_line = tmp;
+                last_cap *= 2;
+            }
+            if (last_line[idx] == line) continue; // Already counted in this session
+            last_line[idx] = line;
+        }
+        if (pairmap_add(counts, seg + 1, idx + 1, weight)) {
+            fprintf(stderr, "Couldn't allocate memory!");
+            return 1;
+        }
+        segment_total[seg] += weight;
+        if(((++i)%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[11G%lld tokens.", i);
+    }
+    tokenizer_close(tk);
+    free(last_line);
+    if(verbose > 1) fprintf(stderr, "\033[0GProcessed %lld tokens.\n", i);
+    nseg = segment_hash->size;
+    entries = pairmap_sort(counts); // Grouped by segment, as its index is the high half of the key
+    if(non_ids > 0) fprintf(stderr, "Skipped %lld tokens that are not ids.\n", non_ids);
+    if(verbose > 1) fprintf(stderr, "Counted %lld unique words in %lld segments, %lld (segment, word) entries.\n", int_tokens ? id_map->size : vocab_hash->size, nseg, entries);
+    order = malloc(sizeof(long long) * (nseg + 1));
+    start = calloc(nseg + 1, sizeof(long long));
+    vocab = malloc(sizeof(VOCAB) * (entries + 1));
+    if (int_tokens) text = malloc(21 * (entries + 1));
+    if (order == NULL || start == NULL || vocab == NULL || (int_tokens && text == NULL)) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    for(j = 0; j < entries; j++) start[pairmap_word1(&counts->slots[j])]++; // start[seg + 1] counts the entries of seg
+    for(j = 0; j < nseg; j++) {
+        start[j + 1] += start[j];
+        order[j] = j;
+    }
+    qsort(order, nseg, sizeof(long long), CompareSegment);
+    for(j = 0; j < nseg; j++) {
+        seg = order[j];
+        for(n = 0, i = start[seg]; i < start[seg + 1]; i++, n++) {
+            vocab[n].word = word_text(vocab_hash, id_map, pairmap_word2(&counts->slots[i]) - 1, text + 21 * n);
+            vocab[n].count = (long long)counts->slots[i].val;
+            vocab[n].bucket = bitwisehash(vocab[n].word, 1048576, 1159241);
         }
-        printf("%s %lld\n",vocab[i].word,vocab[i].count);
+        words += write_vocab(vocab, n, vocabhash_word(segment_hash, seg));
     }
-    
-    if(i == max_vocab && max_vocab < j) if(verbose > 0) fprintf(stderr, "Truncating vocabulary at size %lld.\n", max_vocab);
-    fprintf(stderr, "Using vocabulary of size %lld.\n\n", i);
+    fprintf(stderr, "Using %lld segments with %lld words in total.\n\n", nseg, words);
+    free(text);
     return 0;
 }
 
@@ -197,6 +344,14 @@ int main(int argc, char **argv) {
         printf("\t\tUpper bound on vocabulary size, i.e. keep the <int> most frequent words. The minimum frequency words are randomly sampled so as to obtain an even distribution over the alphabet.\n");
         printf("\t-min-count <int>\n");
         printf("\t\tLower limit such that words which occur fewer than <int> times are discarded.\n");
+        printf("\t-session <int>\n");
+        printf("\t\tIf <int> = 1, treat each line as a session and count a word at most once per line, matching cooccur -session 1; default 0\n");
+        printf("\t-segments <int>\n");
+        printf("\t\tIf <int> = 1, the first token of each line is a segment key; write one vocabulary per segment as lines\n\t\t'segment word count', largest segment first, with -max-vocab and -min-count applied per segment. Default 0\n");
+        printf("\t-weighted <int>\n");
+        printf("\t\tIf <int> = 1, the first token of each line is a count and the line stands for that many copies of itself, as written by dedup\n\t\t(before the segment key with -segments 1). Default 0\n");
+        printf("\t-int-tokens <int>\n");
+        printf("\t\tIf <int> = 1, words are numeric ids (canonical decimal, below 2^64) hashed as integers without keeping their strings;\n\t\tother tokens are skipped. Segment keys and -weighted counts are not words. Default 0\n");
         printf("\nExample usage:\n");
         printf("./vocab_count -verbose 2 -max-vocab 100000 -min-count 10 < corpus.txt > vocab.txt\n");
         return 0;
@@ -205,6 +360,10 @@ int main(int argc, char **argv) {
     if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-max-vocab", argc, argv)) > 0) max_vocab = atoll(argv[i + 1]);
     if ((i = find_arg((char *)"-min-count", argc, argv)) > 0) min_count = atoll(argv[i + 1]);
-    return get_counts();
+    if ((i = find_arg((char *)"-session", argc, argv)) > 0) session = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-segments", argc, argv)) > 0) segments = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-weighted", argc, argv)) > 0) weighted = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-int-tokens", argc, argv)) > 0) int_tokens = atoi(argv[i + 1]);
+    return segments ? get_segment_counts() : get_counts();
 }
 
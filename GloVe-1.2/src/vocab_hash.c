@@ -0,0 +1,158 @@
+//  Open-addressing string interning table shared by vocab_count and cooccur
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include "vocab_hash.h"
+
+#define VH_MIN_SLOTS 1024
+#define VH_SEED 1159241ULL
+
+static inline unsigned long long rotl64(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Murmur3 finalizer */
+static inline unsigned long long fmix64(unsigned long long h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+unsigned long long vocabhash_hash(const char *w, int len) {
+    unsigned long long h = VH_SEED ^ ((unsigned long long)len * 0x9e3779b97f4a7c15ULL), v;
+    while (len >= 8) {
+        memcpy(&v, w, 8);
+        h = rotl64(h ^ (v * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+        w += 8;
+        len -= 8;
+    }
+    if (len > 0) {
+        v = 0;
+        memcpy(&v, w, len);
+        h = rotl64(h ^ (v * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+    }
+    return fmix64(h);
+}
+
+static VHENT *alloc_slots(long long n) {
+    VHENT *slots = malloc(sizeof(VHENT) * n);
+    long long i;
+    if (slots == NULL) return NULL;
+    for (i = 0; i < n; i++) slots[i].idx = VH_EMPTY;
+    return slots;
+}
+
+VOCABHASH *vocabhash_create(long long expected) {
+    VOCABHASH *ht = malloc(sizeof(VOCABHASH));
+    long long n = VH_MIN_SLOTS;
+    if (ht == NULL) return NULL;
+    while (n * 4 < expected * 5) n <<= 1; // keep the load factor below 0.8
+    ht->slots = alloc_slots(n);
+    ht->mask = n - 1;
+    ht->size = 0;
+    ht->arena_cap = 8 * n;
+    ht->arena_len = 0;
+    ht->arena = malloc(ht->arena_cap);
+    ht->offset_cap = n;
+    ht->offset = malloc(sizeof(long long) * ht->offset_cap);
+    if (ht->slots == NULL || ht->arena == NULL || ht->offset == NULL) {
+        vocabhash_free(ht);
+        return NULL;
+    }
+    return ht;
+}
+
+void vocabhash_free(VOCABHASH *ht) {
+    if (ht == NULL) return;
+    free(ht->slots);
+    free(ht->arena);
+    free(ht->offset);
+    free(ht);
+}
+
+/* Robin Hood placement of an entry known to be absent */
+static void place(VHENT *slots, long long mask, VHENT e) {
+    long long pos = e.hash & mask, dist = 0, d;
+    VHENT t;
+    while (slots[pos].idx != VH_EMPTY) {
+        d = (pos - (long long)(slots[pos].hash & mask)) & mask;
+        if (d < dist) { // steal from the rich
+            t = slots[pos];
+            slots[pos] = e;
+            e = t;
+            dist = d;
+        }
+        pos = (pos + 1) & mask;
+        dist++;
+    }
+    slots[pos] = e;
+}
+
+static int grow(VOCABHASH *ht) {
+    long long n = (ht->mask + 1) << 1, i;
+    VHENT *slots = alloc_slots(n);
+    if (slots == NULL) return 1;
+    for (i = 0; i <= ht->mask; i++)
+        if (ht->slots[i].idx != VH_EMPTY) place(slots, n - 1, ht->slots[i]);
+    free(ht->slots);
+    ht->slots = slots;
+    ht->mask = n - 1;
+    return 0;
+}
+
+long long vocabhash_find(const VOCABHASH *ht, const char *w, int len, unsigned long long h) {
+    long long mask = ht->mask, pos = h & mask, dist = 0;
+    const VHENT *s;
+    for (;; pos = (pos + 1) & mask, dist++) {
+        s = &ht->slots[pos];
+        if (s->idx == VH_EMPTY || ((pos - (long long)(s->hash & mask)) & mask) < dist) return -1;
+        if (s->hash == h && s->len == (unsigned int)len && memcmp(ht->arena + ht->offset[s->idx], w, len) == 0) return s->idx;
+    }
+}
+
+long long vocabhash_insert(VOCABHASH *ht, const char *w, int len, unsigned long long h, int *inserted) {
+    long long idx = vocabhash_find(ht, w, len, h);
+    VHENT e;
+    if (inserted) *inserted = (idx < 0);
+    if (idx >= 0) return idx;
+
+    if ((ht->size + 1) * 5 > (ht->mask + 1) * 4 && grow(ht)) return -1;
+    while (ht->arena_len + len + 1 > ht->arena_cap) {
+        char *arena = realloc(ht->arena, ht->arena_cap * 2);
+        if (arena == NULL) return -1;
+        ht->arena = arena;
+        ht->arena_cap *= 2;
+    }
+    if (ht->size == ht->offset_cap) {
+        long long *offset = realloc(ht->offset, sizeof(long long) * ht->offset_cap * 2);
+        if (offset == NULL) return -1;
+        ht->offset = offset;
+        ht->offset_cap *= 2;
+    }
+    idx = ht->size++;
+    ht->offset[idx] = ht->arena_len;
+    memcpy(ht->arena + ht->arena_len, w, len);
+    ht->arena[ht->arena_len + len] = 0;
+    ht->arena_len += len + 1;
+
+    e.hash = h;
+    e.len = len;
+    e.idx = (unsigned int)idx;
+    place(ht->slots, ht->mask, e);
+    return idx;
+}
@@ -0,0 +1,55 @@
+//  Open-addressing string interning table shared by vocab_count and cooccur
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef _VOCAB_HASH_H_
+#define _VOCAB_HASH_H_
+
+/* One slot of the Robin Hood table. Strings live in the arena; the slot keeps the full hash and the length
+ * so that mismatches are almost always rejected without touching the string. */
+typedef struct vocab_hash_entry {
+    unsigned long long hash;
+    unsigned int len;
+    unsigned int idx;      // insertion index, VH_EMPTY for a free slot
+} VHENT;
+
+#define VH_EMPTY 0xffffffffu
+
+typedef struct vocab_hash {
+    VHENT *slots;
+    long long mask;        // number of slots - 1, always a power of two minus one
+    long long size;        // number of interned strings
+    char *arena;           // interned strings, NUL-terminated, in insertion order
+    long long arena_len, arena_cap;
+    long long *offset;     // arena offset of each string, by insertion index
+    long long offset_cap;
+} VOCABHASH;
+
+/* Word-at-a-time 64-bit hash of w[0..len) */
+unsigned long long vocabhash_hash(const char *w, int len);
+
+VOCABHASH *vocabhash_create(long long expected);
+void vocabhash_free(VOCABHASH *ht);
+
+/* Return the insertion index of w, or -1 if it is absent; h must be vocabhash_hash(w, len) */
+long long vocabhash_find(const VOCABHASH *ht, const char *w, int len, unsigned long long h);
+
+/* Return the insertion index of w, interning it first if it is absent; *inserted (if not NULL) tells which. -1 when out of memory. */
+long long vocabhash_insert(VOCABHASH *ht, const char *w, int len, unsigned long long h, int *inserted);
+
+/* Interned string with the given insertion index */
+static inline char *vocabhash_word(const VOCABHASH *ht, long long idx) {
+    return ht->arena + ht->offset[idx];
+}
+
+#endif
@@ -2,16 +2,61 @@
 #define _ITEM_FREQ_H_
 
 #include <memory>
+#include <cstdint>
+#include <cmath>
 #include <deque>
+#include <vector>
 #include <iostream>
 #include <algorithm>
 #include "error.h"
 
 
+// How ItemInfo holds its item: strings are shared with the vocabulary lists the build keeps
+template <typename ItemType>
+struct ItemStorageTraits {
+    typedef typename std::shared_ptr<ItemType> ItemPtr;
+
+    static ItemPtr make( ItemType &&item )
+    { return std::make_shared<ItemType>( std::move(item) ); }
+    static const ItemType& get( const ItemPtr &pItem )
+    { return *pItem; }
+};
+
+// numeric item ids (-int-tokens) are held by value, with no string or allocation behind them
+template <>
+struct ItemStorageTraits<uint64_t> {
+    typedef uint64_t ItemPtr;
+
+    static ItemPtr make( uint64_t item )
+    { return item; }
+    static uint64_t get( ItemPtr pItem )
+    { return pItem; }
+};
+
+
+// What ranks the concur items b of a row a, from count(a), count(b), count(a, b) and N, the summed count of the vocabulary
+enum ItemScore {
+    SCORE_COND,         // P(b|a) = count(a, b) / count(a), the confidence of a => b
+    SCORE_LIFT,         // P(b|a) / P(b) = count(a, b) * N / (count(a) * count(b))
+    SCORE_PMI,          // log(lift)
+    SCORE_JACCARD,      // count(a, b) / (count(a) + count(b) - count(a, b))
+    N_SCORES
+};
+
+inline
+const char* item_score_name( ItemScore score )
+{
+    static const char *names[] = { "cond", "lift", "pmi", "jaccard" };
+    return names[score];
+}
+
+
 template <typename ItemType>
 class ItemFreqDB {
 public:
-    typedef typename std::shared_ptr<ItemType> ItemPtr;
+    typedef ItemType                                  Item;
+    typedef ItemStorageTraits<ItemType>               StorageTraits;
+    typedef typename StorageTraits::ItemPtr           ItemPtr;
 
     struct ConcurItemInfo {
         ConcurItemInfo() : id(0), condCount(0), condFreq(0.0) {}
@@ -29,9 +74,12 @@ public:
     };
 
     struct ItemInfo {
-        ItemInfo() : id(0), count(0) {}
+        ItemInfo() : id(0), pItem(), count(0) {}
         ItemInfo( const ItemPtr &_pItem, uint32_t _id, uint32_t _count ) 
-                : pItem(_pItem), id(_id), count(_count) {}
+                : id(_id), pItem(_pItem), count(_count) {}
+
+        decltype(StorageTraits::get(ItemPtr())) item() const
+        { return StorageTraits::get(pItem); }
 
         uint32_t                   id;
         ItemPtr                    pItem;
@@ -42,15 +90,27 @@ public:
     typedef std::deque<ItemInfo>   ItemArray;
 
 public:
-    ItemFreqDB( uint32_t startID, uint32_t topK ) 
+    // condFreq of the concur items holds the value of score, by which the top K are kept
+    ItemFreqDB( uint32_t startID, uint32_t topK, ItemScore score = SCORE_COND ) 
             : m_nStartID(startID)
             , m_nTopK(topK)
+            , m_eScore(score)
+            , m_nTotal(0)
     { m_arrItems.resize(startID); }
 
     void addItem( const ItemPtr &pItem, uint32_t count )
     { 
         uint32_t id = size();
         m_arrItems.emplace_back(pItem, id, count); 
+        m_nTotal += count;
+    }
+
+    // an item that is only ever a concur item (a bipartite target): no row, just its count for the scores, its id
+    // following the rows and the column items added before it
+    void addColumnItem( uint32_t count )
+    {
+        m_arrColumnCounts.push_back(count);
+        m_nTotal += count;
     }
 
     void addConcurItem( uint32_t mainId, uint32_t itemId, uint32_t condCount )
@@ -63,7 +123,7 @@ public:
                     << mainId << " out of range!" );
 
         ItemInfo &item = m_arrItems[mainId];
-        double condFreq = (double)condCount / item.count;
+        double condFreq = score(item.count, itemId, condCount);
 
         // smaller root heap
         auto &concurItems = item.concurItems;
@@ -98,15 +158,43 @@ public:
     std::size_t size() const
     { return m_arrItems.size(); }
 
+    ItemScore score() const
+    { return m_eScore; }
+
     const uint32_t minID() const
     { return m_nStartID; }
     const uint32_t maxID() const
     { return m_arrItems.back().id; }
 
 private:
-    const uint32_t m_nStartID;
-    const uint32_t m_nTopK;
-    ItemArray      m_arrItems;
+    double score( uint32_t count, uint32_t itemId, uint32_t condCount ) const
+    {
+        if (m_eScore == SCORE_COND)
+            return (double)condCount / count;
+
+        if (itemId < m_nStartID || itemId >= size() + m_arrColumnCounts.size())
+            throw_runtime_error( std::stringstream() << "ItemFreqDB::addConcurItem() itemId "
+                    << itemId << " out of range!" );
+        double countA = count;
+        double countB = itemId < size() ? m_arrItems[itemId].count : m_arrColumnCounts[itemId - size()];
+        switch (m_eScore) {
+        case SCORE_LIFT:
+            return condCount * (double)m_nTotal / (countA * countB);
+        case SCORE_PMI:
+            return std::log( condCount * (double)m_nTotal / (countA * countB) );
+        default:
+            // window counts can exceed the count of an item, so the union is at least the larger item
+            return condCount / std::max( countA + countB - condCount, std::max(countA, countB) );
+        } // switch
+    }
+
+private:
+    const uint32_t  m_nStartID;
+    const uint32_t  m_nTopK;
+    const ItemScore m_eScore;
+    uint64_t        m_nTotal;      // N, the summed count of the items
+    ItemArray       m_arrItems;
+    std::vector<uint32_t> m_arrColumnCounts;
 };
 
 
@@ -1,9 +1,23 @@
 #include "item_freq.h"
+#include "table_io.h"
+#include "table_snapshot.h"
+#include "snapshot_manager.h"
+#include "reverse_index.h"
 #include <unistd.h>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <climits>
+#include <cmath>
+#include <vector>
+#include <queue>
+#include <numeric>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
 #include <boost/iostreams/stream.hpp>
 #include <boost/iostreams/device/file_descriptor.hpp>
 #include <glog/logging.h>
@@ -11,19 +25,40 @@
 using std::cerr; using std::endl;
 
 enum RunType {
-    BUILD, LOAD
+    BUILD, LOAD, MERGE, DIFF, PATCH
 };
 
 typedef ItemFreqDB<std::string>   StringFreqDB;
+typedef ItemFreqDB<uint64_t>      IdFreqDB;
 std::unique_ptr<StringFreqDB>     g_pFreqDB;
+std::unique_ptr<IdFreqDB>         g_pIdFreqDB;    // -int-tokens: items are numeric ids, no strings kept
 
 static uint32_t      g_nMinCount = 0;
 static uint32_t      g_nMaxVocab = 0;
 static uint32_t      g_nWindowSize = 0;
 static uint32_t      g_nTopK = UINT_MAX;
+static uint32_t      g_nMinPairCount = 0;
+static uint32_t      g_nSession = 0;
+static uint32_t      g_nSegments = 0;
+static uint32_t      g_nDedup = 0;
+static uint32_t      g_nAutoPlan = 0;
+static uint32_t      g_nIntTokens = 0;
+static uint32_t      g_nThreads = 0;
 static float         g_fMemorySize = 0.0;
+static float         g_fBloomFpr = 0.0;
+static float         g_fSubsample = 0.0;
+static float         g_fTolerance = 0.0;
+static const char    *g_cstrTempDir = NULL;
+static const char    *g_cstrConfigs = NULL;
+static const char    *g_cstrSourcePrefix = NULL;
+static const char    *g_cstrTargetPrefix = NULL;
+static std::vector<std::string> g_arrConfigs;   // -configs entries as <window><s|a>
 static const char    *g_cstrInputData = NULL;
+static std::vector<const char*> g_arrInputs;    // merge: the tables to combine; diff: old and new table; patch: old table and delta
 static const char    *g_cstrOutputData = NULL;
+static const char    *g_cstrReverseOutput = NULL;  // -reverse-o: the transposed table, for each item b the items a with the top P(b|a)
+static const char    *g_cstrScores = NULL;
+static std::vector<ItemScore> g_arrScores;      // -scores: one table per score, ranked by it
 static int           g_eRunType = BUILD;
 
 static inline
@@ -34,10 +69,34 @@ void print_usage()
     cerr << "Usage: " << endl;
     cerr << "For building frequency table from data file:" << endl;
     cerr << "\t" << "./itemfreq.bin build -i input_data_file -min-count N "
-         << "[-max-vocab N] [-window-size 15(default)] " << "-topk N(default all) "
-         << "[-memory 4.0(default)] -o output_data_file" << endl; 
+         << "[-max-vocab N] [-window-size 15(default) | -session 1] " << "-topk N(default all) [-min-pair-count N] "
+         << "[-memory 4.0(default)] [-bloom-fpr 0.01] [-subsample 1e-4] [-dedup 1] [-auto-plan 1] [-int-tokens 1] [-temp-dir dir] -o output_data_file" << endl; 
+    cerr << "For also writing the transposed table, the items a with the top-K P(b|a) for every item b:" << endl;
+    cerr << "\t" << "./itemfreq.bin build -i input_data_file -min-count N -topk N [other build options] -reverse-o reverse_data_file "
+         << "[-threads N(default all cores)] -o output_data_file" << endl;
+    cerr << "For building one table per association score from a single pass (written to output_data_file.<score>, "
+         << "all but cond headed by a \"" SCORE_HEADER " <score>\" line and not accepted by merge/diff/patch):" << endl;
+    cerr << "\t" << "./itemfreq.bin build -i input_data_file -min-count N -scores cond,lift,pmi,jaccard "
+         << "[other build options] -o output_data_file" << endl;
+    cerr << "For building one table per window configuration from a single pass (written to output_data_file.<config>):" << endl;
+    cerr << "\t" << "./itemfreq.bin build -i input_data_file -min-count N -configs 5s,15s,50a(s: symmetric, a: left only) "
+         << "[other build options] -o output_data_file" << endl;
+    cerr << "For building one table per segment, keyed by the first token of each line (written to output_data_file.<segment>):" << endl;
+    cerr << "\t" << "./itemfreq.bin build -i input_data_file -min-count N -segments 1 [other build options] -o output_data_file" << endl;
+    cerr << "For counting only source-target pairs, e.g. P(product | query), the target rows following with no concur items:" << endl;
+    cerr << "\t" << "./itemfreq.bin build -i input_data_file -min-count N -source-prefix q: -target-prefix p: [other build options]" << endl;
+    cerr << "For merging tables built without -topk / -min-pair-count (e.g. per day) into one (e.g. per week):" << endl;
+    cerr << "\t" << "./itemfreq.bin merge -i table_file -i table_file ... -topk N(default all) [-min-pair-count N] "
+         << "[-threads N(default all cores)] -o output_data_file" << endl;
+    cerr << "For writing the rows of a new table that differ from an old one, beyond a relative tolerance on counts and probabilities:" << endl;
+    cerr << "\t" << "./itemfreq.bin diff -i old_table_file -i new_table_file [-tolerance 0.01(default 0: any change)] -o delta_file" << endl;
+    cerr << "For rebuilding the new table from the old one and a delta:" << endl;
+    cerr << "\t" << "./itemfreq.bin patch -i old_table_file -i delta_file -o new_table_file" << endl;
     cerr << "For loading frequency table file from previous built:" << endl;
     cerr << "\t" << "./itemfreq.bin load -i data_file" << endl;
+    cerr << "\t" << "(answers one item per line on stdin with its row; opening data_file indexes every row in one pass, "
+         << "the concur items being parsed per query; on SIGHUP swaps in data_file again, "
+         << "which must have been replaced by rename, without pausing queries)" << endl;
 }
 
 
@@ -48,10 +107,29 @@ namespace Test {
         cerr << "g_nMinCount = " << g_nMinCount << endl;
         cerr << "g_nMaxVocab = " << g_nMaxVocab << endl;
         cerr << "g_nWindowSize = " << g_nWindowSize << endl;
+        cerr << "g_nTopK = " << g_nTopK << endl;
+        cerr << "g_nMinPairCount = " << g_nMinPairCount << endl;
+        cerr << "g_nSession = " << g_nSession << endl;
+        cerr << "g_nSegments = " << g_nSegments << endl;
+        cerr << "g_nDedup = " << g_nDedup << endl;
+        cerr << "g_nAutoPlan = " << g_nAutoPlan << endl;
+        cerr << "g_nIntTokens = " << g_nIntTokens << endl;
+        cerr << "g_nThreads = " << g_nThreads << endl;
         cerr << "g_fMemorySize = " << g_fMemorySize << endl;
+        cerr << "g_fBloomFpr = " << g_fBloomFpr << endl;
+        cerr << "g_fSubsample = " << g_fSubsample << endl;
+        cerr << "g_fTolerance = " << g_fTolerance << endl;
+        cerr << "g_cstrTempDir = " << (g_cstrTempDir ? g_cstrTempDir : "NULL") << endl;
+        cerr << "g_cstrConfigs = " << (g_cstrConfigs ? g_cstrConfigs : "NULL") << endl;
+        cerr << "g_cstrSourcePrefix = " << (g_cstrSourcePrefix ? g_cstrSourcePrefix : "NULL") << endl;
+        cerr << "g_cstrTargetPrefix = " << (g_cstrTargetPrefix ? g_cstrTargetPrefix : "NULL") << endl;
         cerr << "g_cstrInputData = " << (g_cstrInputData ? g_cstrInputData : "NULL") << endl;
+        cerr << "g_arrInputs = " << g_arrInputs.size() << " tables" << endl;
         cerr << "g_cstrOutputData = " << (g_cstrOutputData ? g_cstrOutputData : "NULL") << endl;
-        cerr << "g_eRunType = " << (g_eRunType == BUILD ? "BUILD" : "LOAD") << endl;
+        cerr << "g_cstrReverseOutput = " << (g_cstrReverseOutput ? g_cstrReverseOutput : "NULL") << endl;
+        cerr << "g_cstrScores = " << (g_cstrScores ? g_cstrScores : "NULL") << endl;
+        static const char *runTypeNames[] = { "BUILD", "LOAD", "MERGE", "DIFF", "PATCH" };
+        cerr << "g_eRunType = " << runTypeNames[g_eRunType] << endl;
     }
 } // namespace Test
 
@@ -79,11 +157,11 @@ void parse_args( int argc, char **argv )
             optc = *parg;
             if (!optc)
                 print_and_exit();
-            if (optc == 'i') {
+            if (optc == 'i' && !parg[1]) {    // not -int-tokens
                 if (++i >= argc)
                     print_and_exit();
                 g_cstrInputData = argv[i];
-            } else if (optc == 'o') {
+            } else if (optc == 'o' && !parg[1]) {
                 if (++i >= argc)
                     print_and_exit();
                 g_cstrOutputData = argv[i];
@@ -107,11 +185,124 @@ void parse_args( int argc, char **argv )
                     print_and_exit();
                 if (sscanf(argv[i], "%u", &g_nTopK) != 1)
                     print_and_exit();
+            } else if (strcmp(parg, "min-pair-count") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nMinPairCount) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "session") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nSession) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "segments") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nSegments) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "dedup") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nDedup) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "auto-plan") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nAutoPlan) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "int-tokens") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nIntTokens) != 1)
+                    print_and_exit();
             } else if (strcmp(parg, "memory") == 0) {
                 if (++i >= argc)
                     print_and_exit();
                 if (sscanf(argv[i], "%f", &g_fMemorySize) != 1)
                     print_and_exit();
+            } else if (strcmp(parg, "bloom-fpr") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%f", &g_fBloomFpr) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "subsample") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%f", &g_fSubsample) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "temp-dir") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                g_cstrTempDir = argv[i];
+            } else if (strcmp(parg, "source-prefix") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                g_cstrSourcePrefix = argv[i];
+            } else if (strcmp(parg, "target-prefix") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                g_cstrTargetPrefix = argv[i];
+            } else if (strcmp(parg, "reverse-o") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                g_cstrReverseOutput = argv[i];
+            } else if (strcmp(parg, "threads") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nThreads) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "configs") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                g_cstrConfigs = argv[i];
+            } else if (strcmp(parg, "scores") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                g_cstrScores = argv[i];
+            } else {
+                print_and_exit();
+            } // if
+
+            ++i;
+        } // for
+
+    } else if (strcmp(argv[1], "merge") == 0 || strcmp(argv[1], "diff") == 0 || strcmp(argv[1], "patch") == 0) {
+        g_eRunType = argv[1][0] == 'm' ? MERGE : (argv[1][0] == 'd' ? DIFF : PATCH);
+        for (i = 2; i < argc;) {
+            parg = argv[i];
+            if ( *parg++ != '-' )
+                print_and_exit();
+            optc = *parg;
+            if (!optc)
+                print_and_exit();
+            if (optc == 'i' && !parg[1]) {
+                if (++i >= argc)
+                    print_and_exit();
+                g_arrInputs.push_back(argv[i]);
+            } else if (optc == 'o' && !parg[1]) {
+                if (++i >= argc)
+                    print_and_exit();
+                g_cstrOutputData = argv[i];
+            } else if (strcmp(parg, "topk") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nTopK) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "min-pair-count") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nMinPairCount) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "threads") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%u", &g_nThreads) != 1)
+                    print_and_exit();
+            } else if (strcmp(parg, "tolerance") == 0) {
+                if (++i >= argc)
+                    print_and_exit();
+                if (sscanf(argv[i], "%f", &g_fTolerance) != 1)
+                    print_and_exit();
             } else {
                 print_and_exit();
             } // if
@@ -158,27 +349,203 @@ void check_args()
             err_exit( "arg error: no input data file specified." );
         if (!g_nMinCount)
             err_exit( "arg error: -min-count must be specified." );
+        if (!g_cstrSourcePrefix != !g_cstrTargetPrefix)
+            err_exit( "arg error: -source-prefix and -target-prefix must be specified together." );
+        if (g_nSegments && !g_cstrOutputData)
+            err_exit( "arg error: -segments writes one file per segment, -o must be specified." );
+        if (g_nSegments && g_cstrConfigs)
+            err_exit( "arg error: -segments and -configs cannot be combined." );
+        if (g_nIntTokens && g_cstrSourcePrefix)
+            err_exit( "arg error: -int-tokens items are numeric ids, they cannot carry -source-prefix/-target-prefix." );
+        if (g_cstrReverseOutput && (g_cstrConfigs || g_nSegments))
+            err_exit( "arg error: -reverse-o cannot be combined with -configs or -segments." );
+        if (g_cstrReverseOutput && g_nTopK == UINT_MAX)
+            err_exit( "arg error: -reverse-o needs -topk, without it every pair of an item is kept in memory." );
+        if (g_cstrScores) {
+            if (!g_cstrOutputData)
+                err_exit( "arg error: -scores writes one file per score, -o must be specified." );
+            if (g_cstrConfigs || g_nSegments)
+                err_exit( "arg error: -scores cannot be combined with -configs or -segments." );
+            stringstream str(g_cstrScores);
+            string name;
+            while (getline(str, name, ',')) {
+                int score = 0;
+                while (score < N_SCORES && name != item_score_name((ItemScore)score))
+                    ++score;
+                if (score == N_SCORES)
+                    err_exit( "arg error: -scores entries are among cond,lift,pmi,jaccard." );
+                if (std::find(g_arrScores.begin(), g_arrScores.end(), (ItemScore)score) == g_arrScores.end())
+                    g_arrScores.push_back((ItemScore)score);
+            } // while
+            if (g_arrScores.empty())
+                err_exit( "arg error: -scores entries are among cond,lift,pmi,jaccard." );
+        } // if
+        if (!g_nThreads)
+            g_nThreads = std::max(1u, std::thread::hardware_concurrency());
+        if (g_fSubsample < 0.0 || g_fSubsample >= 1.0)
+            err_exit( "arg error: -subsample is a word frequency threshold such as 1e-4." );
+        if (g_fSubsample > 0.0 && g_nSession)
+            err_exit( "arg error: -subsample cannot be combined with -session: a session counts each item once however often it occurs." );
+        if (g_cstrConfigs) {
+            if (!g_cstrOutputData)
+                err_exit( "arg error: -configs writes one file per config, -o must be specified." );
+            if (g_nSession)
+                err_exit( "arg error: -configs and -session cannot be combined." );
+            // cooccur takes a missing direction from -symmetric, which is 0 here
+            stringstream str(g_cstrConfigs);
+            string config;
+            while (getline(str, config, ',')) {
+                if (config.empty() || !isdigit(config[0]))
+                    err_exit( "arg error: -configs entries look like 5s,15s,50a." );
+                if (isdigit(config.back()))
+                    config += 'a';
+                g_arrConfigs.push_back(config);
+            } // while
+        } // if
+    } else if (g_eRunType == MERGE) {
+        if (g_arrInputs.empty())
+            err_exit( "arg error: no table to merge specified." );
+        if (!g_nThreads)
+            g_nThreads = std::max(1u, std::thread::hardware_concurrency());
+    } else if (g_eRunType == DIFF || g_eRunType == PATCH) {
+        if (g_arrInputs.size() != 2)
+            err_exit( g_eRunType == DIFF ? "arg error: diff takes the old and the new table, -i old -i new."
+                    : "arg error: patch takes the old table and the delta, -i old -i delta." );
+        if (g_fTolerance < 0.0)
+            err_exit( "arg error: -tolerance must not be negative." );
     } else if (g_eRunType == LOAD) {
         if (!g_cstrInputData)
             err_exit( "arg error: no input data file specified." );
     } // if
 }
 
+// -segments: the key of a segment as the suffix of its output file; the keys come from the corpus, so '/', '%' and
+// control characters are written as %XX, which keeps the files in the directory of -o and distinct keys apart
+static
+std::string segment_file_suffix( const std::string &key )
+{
+    static const char *hex = "0123456789ABCDEF";
+    std::string suffix;
+    for (unsigned char ch : key) {
+        if (ch == '/' || ch == '%' || ch < 0x20 || ch == 0x7f) {
+            suffix += '%';
+            suffix += hex[ch >> 4];
+            suffix += hex[ch & 15];
+        } else {
+            suffix += ch;
+        } // if
+    } // for
+    return suffix;
+}
+
+// -source-prefix: whether item is a source item; numeric ids carry no prefix, check_args() rules that combination out
+static inline
+bool has_source_prefix( const std::string &item )
+{ return item.compare(0, strlen(g_cstrSourcePrefix), g_cstrSourcePrefix) == 0; }
+static inline
+bool has_source_prefix( uint64_t )
+{ return true; }
+
+// -target-prefix: whether item is a target item, to be checked after has_source_prefix() as cooccur does
+static inline
+bool has_target_prefix( const std::string &item )
+{ return item.compare(0, strlen(g_cstrTargetPrefix), g_cstrTargetPrefix) == 0; }
+static inline
+bool has_target_prefix( uint64_t )
+{ return false; }
+
+template <typename FreqDB>
 static
-void do_build_routine()
+void do_build_routine( std::unique_ptr<FreqDB> &pFreqDB )
 {
     using namespace std;
 
-    typedef std::shared_ptr<std::string>    StringPtr;
+    typedef typename FreqDB::Item           Item;
+    typedef typename FreqDB::ItemPtr        ItemPtr;
 
-    // defined in cooccur
-    struct CREC {
+    // defined in cooccur, record format of -int-counts 1
+    struct CRECI {
         int       word1;
         int       word2;
-        double    val;
+        uint32_t  val;
     };
 
     const char *vocabOutFilename = "_vocab_count.txt";
+    const char *dedupOutFilename = "_dedup.txt";      // -dedup: the distinct lines of the input, each with its count
+    const char *cooccurOutPrefix = "_cooccur";     // -configs: cooccur writes _cooccur_<config>.bin
+    const char *segmentOutPrefix = "_segment";     // -segments: cooccur writes _segment_<n>.bin, n numbering the segments
+
+    typedef std::vector< std::pair<ItemPtr, uint32_t> > VocabList;
+
+    // kept to fill a fresh db for every table of -configs, and to split the sides of -source-prefix
+    VocabList vocabItems;
+    // -segments: the vocabulary of each segment, in the order vocab_count wrote them
+    std::vector< std::pair<string, VocabList> > segmentVocabs;
+
+    // -dedup: vocab_count and cooccur read the collapsed input instead
+    string corpusFilename = g_cstrInputData;
+
+    // -scores: pFreqDB ranks by the first score, and each further one has a db of its own over the same items
+    std::vector< std::unique_ptr<FreqDB> > scoreDBs;
+    if (!g_arrScores.empty()) {
+        pFreqDB.reset( new FreqDB(1, g_nTopK, g_arrScores[0]) );
+        for (std::size_t i = 1; i < g_arrScores.size(); ++i)
+            scoreDBs.emplace_back( new FreqDB(1, g_nTopK, g_arrScores[i]) );
+    } // if
+
+    // -source-prefix: the sources are the rows of the dbs, ids 1 .. |A|, and the targets follow as |A| + 1 .., column
+    // items without a row in the dbs; bipartiteIds maps the vocab indices of the cooccur records to these ids
+    VocabList targetItems;
+    std::vector<uint32_t> bipartiteIds;
+
+    // add the items of vocab, in vocab order, to pFreqDB and the -scores dbs
+    auto add_items = [&]( const VocabList &vocab ) {
+        if (!g_cstrSourcePrefix) {
+            for (const auto &v : vocab) {
+                pFreqDB->addItem( v.first, v.second );
+                for (auto &db : scoreDBs)
+                    db->addItem( v.first, v.second );
+            } // for
+            return;
+        } // if
+
+        // the sides as cooccur tells them apart: a source prefix first, then a target prefix
+        bipartiteIds.assign(vocab.size() + 1, 0);
+        targetItems.clear();
+        for (std::size_t i = 0; i < vocab.size(); ++i) {
+            if (!has_source_prefix(FreqDB::StorageTraits::get(vocab[i].first)))
+                continue;
+            bipartiteIds[i + 1] = pFreqDB->size();
+            pFreqDB->addItem( vocab[i].first, vocab[i].second );
+            for (auto &db : scoreDBs)
+                db->addItem( vocab[i].first, vocab[i].second );
+        } // for
+        for (std::size_t i = 0; i < vocab.size(); ++i) {
+            const auto &item = FreqDB::StorageTraits::get(vocab[i].first);
+            if (has_source_prefix(item) || !has_target_prefix(item))
+                continue;
+            bipartiteIds[i + 1] = pFreqDB->size() + targetItems.size();
+            targetItems.push_back( vocab[i] );
+            pFreqDB->addColumnItem( vocab[i].second );
+            for (auto &db : scoreDBs)
+                db->addColumnItem( vocab[i].second );
+        } // for
+    };
+
+    auto run_dedup = [&] {
+        stringstream str;
+        str << "./dedup.bin -verbose 0";
+        if (g_fMemorySize >= 0.1)
+            str << " -memory " << g_fMemorySize;
+        if (g_cstrTempDir)
+            str << " -temp-dir " << g_cstrTempDir;
+        str << " < " << g_cstrInputData << " > " << dedupOutFilename << flush;
+
+        // LOG(INFO) << "dedupCmd = " << str.str();
+        if (::system(str.str().c_str()) != 0)
+            throw_runtime_error("Running dedup failed!");
+        corpusFilename = dedupOutFilename;
+    };
 
     auto run_vocab_count = [&] {
         typedef boost::iostreams::stream< boost::iostreams::file_descriptor_source >
@@ -191,7 +558,15 @@ void do_build_routine()
         str << "-min-count " << g_nMinCount;
         if (g_nMaxVocab)
             str << " -max-vocab " << g_nMaxVocab;
-        str << " < " << g_cstrInputData << flush;
+        if (g_nSession)
+            str << " -session 1";
+        if (g_nSegments)
+            str << " -segments 1";
+        if (g_nDedup)
+            str << " -weighted 1";
+        if (g_nIntTokens)
+            str << " -int-tokens 1";
+        str << " < " << corpusFilename << flush;
         vocabCmd = std::move(str.str());
 
         // LOG(INFO) << "vocabCmd = " << vocabCmd;
@@ -207,31 +582,131 @@ void do_build_routine()
 
         FDStream pipeStream( fileno(fp), boost::iostreams::never_close_handle );
 
-        StringPtr    pWord;
+        ItemPtr      pWord;
+        Item         word;
         uint32_t     count;
         while (getline(pipeStream, line)) {
             // NOTE!! output on screen is stdout and stderr mixed
             // cerr << "line: " << line << endl;
-            pWord.reset( new string );
             stringstream str(line);
-            str >> *pWord >> count;
-            g_pFreqDB->addItem( pWord, count );
+            if (g_nSegments) {
+                // lines are "segment word count", the words of a segment together
+                string segment;
+                str >> segment >> word >> count;
+                pWord = FreqDB::StorageTraits::make( std::move(word) );
+                if (segmentVocabs.empty() || segmentVocabs.back().first != segment)
+                    segmentVocabs.emplace_back( segment, VocabList() );
+                segmentVocabs.back().second.emplace_back( pWord, count );
+            } else {
+                str >> word >> count;
+                pWord = FreqDB::StorageTraits::make( std::move(word) );
+                if (!g_cstrSourcePrefix) {
+                    pFreqDB->addItem( pWord, count );
+                    for (auto &db : scoreDBs)
+                        db->addItem( pWord, count );
+                } // if
+                if (!g_arrConfigs.empty() || g_cstrSourcePrefix)
+                    vocabItems.emplace_back( pWord, count );
+            } // if
             vocabOutFile << line << endl;
         } // while
-        ::pclose(fp);
+        if (::pclose(fp) != 0)
+            throw_runtime_error("Running vocab_count failed!");
+    };
+
+    // -reverse-o: fed the same pairs as the forward table
+    std::vector<uint32_t> itemCounts;
+    std::unique_ptr<ReverseIndexBuilder> pReverse;
+
+    // the top K of a row by P(b|a) are its top K by count, which cooccur cuts itself; the other scores and the
+    // transposed table need every pair
+    bool allPairs = g_cstrReverseOutput != NULL;
+    for (auto score : g_arrScores)
+        allPairs = allPairs || score != SCORE_COND;
+
+    // feed rec to the dbs ranking by P(b|a), or to the others
+    auto add_pair = [&]( const CRECI &rec, bool cond ) {
+        if ((pFreqDB->score() == SCORE_COND) == cond)
+            pFreqDB->addConcurItem(rec.word1, rec.word2, rec.val);
+        for (auto &db : scoreDBs)
+            if ((db->score() == SCORE_COND) == cond)
+                db->addConcurItem(rec.word1, rec.word2, rec.val);
+    };
+
+    // with every pair coming, the P(b|a) rows are cut to -topk here by the rule of cooccur, the largest counts with
+    // ties to the smaller word2, and fed in word2 order, so the table is the same as when cooccur cuts them
+    vector<CRECI> row;
+    auto flush_row = [&] {
+        if (row.size() > g_nTopK) {
+            partial_sort( row.begin(), row.begin() + g_nTopK, row.end(), []( const CRECI &x, const CRECI &y ) {
+                return x.val != y.val ? x.val > y.val : x.word2 < y.word2;
+            } );
+            row.resize(g_nTopK);
+            sort( row.begin(), row.end(), []( const CRECI &x, const CRECI &y ) { return x.word2 < y.word2; } );
+        } // if
+        for (const auto &rec : row)
+            add_pair(rec, true);
+        row.clear();
+    };
+
+    auto read_cooccur = [&]( FILE *fp ) {
+        CRECI rec;
+        while ( fread(&rec, sizeof(CRECI), 1, fp) == 1 ) {
+            if (!bipartiteIds.empty()) {
+                rec.word1 = bipartiteIds[rec.word1];
+                rec.word2 = bipartiteIds[rec.word2];
+            } // if
+            if (!allPairs) {
+                add_pair(rec, true);
+                continue;
+            } // if
+            if (pReverse)
+                pReverse->add(rec.word1, rec.word2, rec.val);
+            add_pair(rec, false);
+            if (!row.empty() && row.back().word1 != rec.word1)
+                flush_row();
+            row.push_back(rec);
+        } // while
+        flush_row();
     };
 
     auto run_cooccur = [&] {
         string cooccurCmd;
 
         stringstream str;
-        str << "./cooccur.bin -verbose 0 -noseq 1 -symmetric 0 -vocab-file "
+        // -auto-plan: verbose 1 prints the plan, on stderr like the rest of the log
+        str << "./cooccur.bin -verbose " << (g_nAutoPlan ? 1 : 0) << " -noseq 1 -int-counts 1 -symmetric 0 -vocab-file "
                 << vocabOutFilename;
-        if (g_nWindowSize)
+        if (g_nSession)
+            str << " -session 1";
+        else if (!g_arrConfigs.empty())
+            str << " -configs " << g_cstrConfigs << " -config-output " << cooccurOutPrefix;
+        else if (g_nWindowSize)
             str << " -window-size " << g_nWindowSize;
+        if (g_nSegments)
+            str << " -segments 1 -segment-output " << segmentOutPrefix;
+        if (g_cstrSourcePrefix)
+            str << " -source-prefix " << g_cstrSourcePrefix << " -target-prefix " << g_cstrTargetPrefix;
+        if (g_fSubsample > 0.0)
+            str << " -subsample " << g_fSubsample;
+        if (g_nDedup)
+            str << " -weighted 1";
+        if (g_nIntTokens)
+            str << " -int-tokens 1";
         if (g_fMemorySize >= 0.1)
             str << " -memory " << g_fMemorySize;
-        str << " < " << g_cstrInputData << flush;
+        if (g_nAutoPlan)
+            str << " -auto-plan 1";
+        if (g_fBloomFpr > 0.0)
+            str << " -bloom-fpr " << g_fBloomFpr;
+        if (g_cstrTempDir)
+            str << " -temp-dir " << g_cstrTempDir;
+        // cooccur keeps only the pairs addConcurItem() would keep, so they need not go through the pipe
+        if (g_nTopK != UINT_MAX && !allPairs)
+            str << " -topk " << g_nTopK;
+        if (g_nMinPairCount)
+            str << " -min-pair-count " << g_nMinPairCount;
+        str << " < " << corpusFilename << flush;
 
         cooccurCmd = std::move(str.str());
         // LOG(INFO) << "cooccurCmd = " << cooccurCmd;
@@ -239,30 +714,29 @@ void do_build_routine()
         if (!fp)
             throw_runtime_error("Launching cooccur failed!");
 
-        CREC rec;
-        while ( fread(&rec, sizeof(CREC), 1, fp) == 1 ) {
-            g_pFreqDB->addConcurItem(rec.word1, rec.word2, (uint32_t)(rec.val));
-        } // while
+        // with -configs the tables go to files and nothing comes through the pipe
+        read_cooccur(fp);
 
-        ::pclose(fp);
+        if (::pclose(fp) != 0)
+            throw_runtime_error("Running cooccur failed!");
 
-        // g_pFreqDB->checkConsistency();
+        // pFreqDB->checkConsistency();
     };
 
-    auto sort_db = [&] {
+    auto sort_db = [&]( FreqDB &db ) {
         // TODO should use heap to keep top first
         // TODO openmp
-        auto &items = g_pFreqDB->items();
+        auto &items = db.items();
         for (size_t i = 0; i < items.size(); ++i)
             sort_heap( items[i].concurItems.begin(), items[i].concurItems.end(), 
-                    std::greater<StringFreqDB::ConcurItemInfo>() );
+                    std::greater<typename FreqDB::ConcurItemInfo>() );
     };
 
-    auto dump_db = [&]( ostream &os ) {
-        for (uint32_t i = g_pFreqDB->minID(); i <= g_pFreqDB->maxID(); ++i) {
-            const auto &item = g_pFreqDB->items()[i];
-            // os << item.id << ":" << *(item.pItem) << ":" << item.count << "\t";
-            os << *(item.pItem) << ":" << item.count << "\t";
+    auto dump_db = [&]( const FreqDB &db, ostream &os ) {
+        for (uint32_t i = db.minID(); i <= db.maxID(); ++i) {
+            const auto &item = db.items()[i];
+            // os << item.id << ":" << item.item() << ":" << item.count << "\t";
+            os << item.item() << ":" << item.count << "\t";
             const auto &concurItems = item.concurItems;
             if (!concurItems.empty()) {
                 for (uint32_t j = 0; j < concurItems.size(); ++j) {
@@ -273,24 +747,532 @@ void do_build_routine()
             } // if
             os << endl;
         } // for i
+        // -source-prefix: the targets, rows without concur items, so that row k is still the item with id k
+        for (const auto &target : targetItems)
+            os << FreqDB::StorageTraits::get(target.first) << ":" << target.second << "\t" << endl;
+    };
+
+    // -configs / -segments: load a table cooccur wrote to a file into a fresh db over vocab, then dump it
+    auto dump_table = [&]( const VocabList &vocab, const string &tableFilename, const string &outFilename ) {
+        pFreqDB.reset( new FreqDB(1, g_nTopK) );
+        add_items(vocab);
+        // cooccur writes every table, an empty one for a segment without pairs
+        FILE *fp = ::fopen(tableFilename.c_str(), "rb");
+        if (!fp)
+            throw_runtime_error( stringstream() << "Cannot open cooccur table " << tableFilename );
+        read_cooccur(fp);
+        ::fclose(fp);
+        ::remove(tableFilename.c_str());
+        pFreqDB->checkConsistency();
+        sort_db(*pFreqDB);
+        ofstream ofs(outFilename, ios::out);
+        if (!ofs)
+            throw_runtime_error( stringstream() << "Cannot open " << outFilename << " for writing!" );
+        dump_db(*pFreqDB, ofs);
+    };
+
+    // -reverse-o: row b lists a:count(a, b):P(b|a), best first, in the format of the forward table
+    auto dump_reverse = [&] {
+        ofstream ofs(g_cstrReverseOutput, ios::out);
+        if (!ofs)
+            throw_runtime_error( stringstream() << "Cannot open " << g_cstrReverseOutput << " for writing!" );
+        pReverse->finish( ofs, [&]( ostream &os, uint32_t b, vector<ReverseIndexBuilder::Entry>::const_iterator first,
+                vector<ReverseIndexBuilder::Entry>::const_iterator last ) {
+            if (b < pFreqDB->size())
+                os << pFreqDB->items()[b].item() << ":" << pFreqDB->items()[b].count << "\t";
+            else
+                os << FreqDB::StorageTraits::get(targetItems[b - pFreqDB->size()].first) << ":" << itemCounts[b] << "\t";
+            for (; first != last; ++first)
+                os << first->a << ":" << first->count << ":" << (double)first->count / itemCounts[first->a] << " ";
+            os << "\n";
+        } );
+        pReverse.reset();
     };
 
+    if (g_nDedup)
+        run_dedup();
     run_vocab_count();
+    if (g_cstrSourcePrefix && g_arrConfigs.empty() && !g_nSegments)
+        add_items(vocabItems);
+    if (g_cstrReverseOutput) {
+        itemCounts.resize(pFreqDB->size(), 0);
+        for (uint32_t i = pFreqDB->minID(); i < pFreqDB->size(); ++i)
+            itemCounts[i] = pFreqDB->items()[i].count;
+        for (const auto &target : targetItems)
+            itemCounts.push_back( target.second );
+        // the bound on its buffers: a quarter of -memory, which cooccur is using meanwhile
+        double memory = (g_fMemorySize >= 0.1 ? g_fMemorySize : 4.0) * 0.25 * 1073741824;
+        pReverse.reset( new ReverseIndexBuilder(itemCounts, g_nTopK, (uint64_t)memory, g_nThreads,
+                string(g_cstrTempDir ? g_cstrTempDir : ".") + "/_reverse") );
+    } // if
     run_cooccur();
-    g_pFreqDB->checkConsistency();
-    sort_db();
+    if (pReverse)
+        dump_reverse();
+    if (g_nDedup)
+        ::remove(dedupOutFilename);
+
+    if (!g_arrConfigs.empty()) {
+        for (const auto &config : g_arrConfigs)
+            dump_table( vocabItems, string(cooccurOutPrefix) + "_" + config + ".bin",
+                    string(g_cstrOutputData) + "." + config );
+        return;
+    } // if
+
+    if (g_nSegments) {
+        for (std::size_t i = 0; i < segmentVocabs.size(); ++i)
+            dump_table( segmentVocabs[i].second, string(segmentOutPrefix) + "_" + to_string(i) + ".bin",
+                    string(g_cstrOutputData) + "." + segment_file_suffix(segmentVocabs[i].first) );
+        return;
+    } // if
+
+    if (!g_arrScores.empty()) {
+        auto dump_score = [&]( FreqDB &db ) {
+            db.checkConsistency();
+            sort_db(db);
+            ofstream ofs(string(g_cstrOutputData) + "." + item_score_name(db.score()), ios::out);
+            // only cond rows are P(b|a); the others are marked so that merge/diff/patch refuse them
+            if (db.score() != SCORE_COND)
+                ofs << SCORE_HEADER << " " << item_score_name(db.score()) << endl;
+            dump_db(db, ofs);
+        };
+        dump_score(*pFreqDB);
+        for (auto &db : scoreDBs) {
+            dump_score(*db);
+            db.reset();
+        } // for
+        return;
+    } // if
+
+    pFreqDB->checkConsistency();
+    sort_db(*pFreqDB);
 
     if (g_cstrOutputData) {
         ofstream ofs(g_cstrOutputData, ios::out);
-        dump_db(ofs);
+        dump_db(*pFreqDB, ofs);
     } else {
-        dump_db(cout);
+        dump_db(*pFreqDB, cout);
     } // if
 }
 
+// -o if given, else stdout
+static
+std::ostream& open_output( std::ofstream &ofs )
+{
+    if (!g_cstrOutputData)
+        return std::cout;
+    ofs.open(g_cstrOutputData, std::ios::out);
+    if (!ofs)
+        throw_runtime_error( std::stringstream() << "Cannot open " << g_cstrOutputData << " for writing!" );
+    return ofs;
+}
+
+/*
+ * Sum several tables into one, as if their corpora had been counted together. The vocabularies are reconciled by item
+ * and ranked again by the summed counts; then the rows are read in merged id order, a k-way merge over the tables
+ * each walking its rows in that order through its offset index, so no more than a batch of rows is held at a time.
+ * The pair counts of a batch are summed, and condFreq and top-K recomputed, by g_nThreads threads.
+ * Pairs an input table dropped through -topk or -min-pair-count are missing from the sums.
+ */
+static
+void do_merge_routine()
+{
+    using namespace std;
+
+    typedef vector< pair<uint32_t, uint64_t> >  ConcurList;
+
+    const uint32_t BATCH_ROWS = 8192;
+
+    vector< unique_ptr<TableIndex> > tables;
+    for (const char *filename : g_arrInputs)
+        tables.emplace_back( new TableIndex(filename) );
+
+    // merged vocabulary: items in order of first appearance with their summed counts
+    unordered_map<string, uint32_t> itemIndex;
+    vector< pair<string, uint64_t> > vocab;
+    vector< vector<uint32_t> > tableItems(tables.size());     // index in vocab of each row of each table
+    for (size_t t = 0; t < tables.size(); ++t) {
+        const TableIndex &table = *tables[t];
+        tableItems[t].resize(table.size() + 1);
+        for (uint32_t id = 1; id <= table.size(); ++id) {
+            const auto &item = table.item(id);
+            auto ret = itemIndex.emplace( item.first, (uint32_t)vocab.size() );
+            if (ret.second)
+                vocab.emplace_back( item.first, 0 );
+            vocab[ret.first->second].second += item.second;
+            tableItems[t][id] = ret.first->second;
+        } // for id
+    } // for t
+    itemIndex.clear();
+
+    // merged ids: larger counts first, ties by item, as vocab_count ranks them
+    vector<uint32_t> order(vocab.size()), mergedID(vocab.size());
+    iota( order.begin(), order.end(), 0 );
+    sort( order.begin(), order.end(), [&]( uint32_t a, uint32_t b ) {
+        return vocab[a].second != vocab[b].second ? vocab[a].second > vocab[b].second : vocab[a].first < vocab[b].first;
+    } );
+    for (uint32_t i = 0; i < order.size(); ++i)
+        mergedID[order[i]] = i + 1;
+
+    // every table's rows as (merged id, table id), in merged id order, and its table ids translated
+    vector< vector< pair<uint32_t, uint32_t> > > rows(tables.size());
+    for (size_t t = 0; t < tables.size(); ++t) {
+        auto &tableIDs = tableItems[t];
+        rows[t].reserve(tables[t]->size());
+        for (uint32_t id = 1; id < tableIDs.size(); ++id) {
+            tableIDs[id] = mergedID[tableIDs[id]];
+            rows[t].emplace_back( tableIDs[id], id );
+        } // for
+        sort( rows[t].begin(), rows[t].end() );
+        for (size_t k = 1; k < rows[t].size(); ++k)
+            if (rows[t][k].first == rows[t][k - 1].first)
+                throw_runtime_error( stringstream() << tables[t]->filename() << ": item "
+                        << vocab[order[rows[t][k].first - 1]].first << " has more than one row" );
+    } // for t
+
+    // the k-way merge: the next row of each table, smallest merged id on top
+    typedef pair<uint32_t, size_t> Cursor;
+    priority_queue< Cursor, vector<Cursor>, greater<Cursor> > heap;
+    vector<size_t> next(tables.size(), 0);
+    for (size_t t = 0; t < tables.size(); ++t)
+        if (!rows[t].empty())
+            heap.emplace( rows[t][0].first, t );
+
+    ofstream ofs;
+    ostream &os = open_output(ofs);
+
+    // one merged row: sum the pairs of its table rows, then keep the top-K by count, ties to the smaller id
+    auto merge_row = [&]( uint32_t id, const vector< pair<size_t, string> > &sources, string &out ) {
+        TableRow row;
+        ConcurList concurItems;
+        for (const auto &src : sources) {
+            if (!parse_table_row(src.second, row))
+                throw_runtime_error( stringstream() << tables[src.first]->filename() << ": malformed row of item "
+                        << vocab[order[id - 1]].first );
+            const auto &tableIDs = tableItems[src.first];
+            for (const auto &c : row.concurItems) {
+                // every item has a row, the targets of -source-prefix tables included, so an id without one is corrupt
+                if (c.first == 0 || c.first >= tableIDs.size())
+                    throw_runtime_error( stringstream() << tables[src.first]->filename() << ": item id " << c.first
+                            << " has no row; only tables with a row per item can be merged" );
+                concurItems.emplace_back( tableIDs[c.first], c.second );
+            } // for c
+        } // for src
+        sort( concurItems.begin(), concurItems.end() );
+        size_t n = 0;
+        for (size_t k = 0; k < concurItems.size(); ++k) {
+            if (n > 0 && concurItems[n - 1].first == concurItems[k].first)
+                concurItems[n - 1].second += concurItems[k].second;
+            else
+                concurItems[n++] = concurItems[k];
+        } // for
+        concurItems.resize(n);
+        if (g_nMinPairCount)
+            concurItems.erase( remove_if( concurItems.begin(), concurItems.end(),
+                    []( const pair<uint32_t, uint64_t> &c ) { return c.second < g_nMinPairCount; } ), concurItems.end() );
+        auto byCount = []( const pair<uint32_t, uint64_t> &a, const pair<uint32_t, uint64_t> &b ) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        };
+        if (concurItems.size() > g_nTopK) {
+            partial_sort( concurItems.begin(), concurItems.begin() + g_nTopK, concurItems.end(), byCount );
+            concurItems.resize(g_nTopK);
+        } else {
+            sort( concurItems.begin(), concurItems.end(), byCount );
+        } // if
+        const auto &item = vocab[order[id - 1]];
+        stringstream str;
+        write_table_row( str, item.first, item.second, concurItems );
+        out = str.str();
+    };
+
+    vector< vector< pair<size_t, string> > > batch(BATCH_ROWS);
+    vector<string> output(BATCH_ROWS);
+    for (uint32_t first = 1; first <= vocab.size(); first += BATCH_ROWS) {
+        uint32_t n = min<uint32_t>( BATCH_ROWS, vocab.size() - first + 1 );
+        for (uint32_t i = 0; i < n; ++i)
+            batch[i].clear();
+        while (!heap.empty() && heap.top().first < first + n) {
+            Cursor cur = heap.top();
+            heap.pop();
+            size_t t = cur.second;
+            batch[cur.first - first].emplace_back( t, string() );
+            tables[t]->readRow( rows[t][next[t]].second, batch[cur.first - first].back().second );
+            if (++next[t] < rows[t].size())
+                heap.emplace( rows[t][next[t]].first, t );
+        } // while
+
+        vector<thread> workers;
+        vector<exception_ptr> errors(g_nThreads);
+        for (uint32_t w = 0; w < g_nThreads; ++w)
+            workers.emplace_back( [&, w] {
+                try {
+                    for (uint32_t i = w; i < n; i += g_nThreads)
+                        merge_row( first + i, batch[i], output[i] );
+                } catch (...) {
+                    errors[w] = current_exception();
+                } // try
+            } );
+        for (auto &worker : workers)
+            worker.join();
+        for (auto &error : errors)
+            if (error)
+                rethrow_exception(error);
+
+        for (uint32_t i = 0; i < n; ++i)
+            os << output[i];
+    } // for first
+    os << flush;
+}
+
+/*
+ * Write the delta turning the table g_arrInputs[0] into g_arrInputs[1] (format in table_io.h). The new table is walked in id
+ * order and the old row of the same item fetched through the old table's offset index; the new row is copied when the
+ * old one has the same concur items, and its count and every condFreq are within g_fTolerance of the old ones (relative),
+ * else written out. With the default tolerance 0 only unchanged rows are copied and patch rebuilds the new table exactly.
+ * Diff against the table the consumers hold, i.e. the previous patch result, so copied rows do not drift further each time.
+ */
+static
+void do_diff_routine()
+{
+    using namespace std;
+
+    TableIndex oldTable(g_arrInputs[0]), newTable(g_arrInputs[1]);
+
+    // old id of the item of every new id, and the other way round; 0 for an item only one table has
+    vector<uint32_t> toOld(newTable.size() + 1, 0), toNew(oldTable.size() + 1, 0);
+    {
+        unordered_map<string, uint32_t> oldIDs;
+        for (uint32_t id = 1; id <= oldTable.size(); ++id)
+            oldIDs.emplace( oldTable.item(id).first, id );
+        for (uint32_t id = 1; id <= newTable.size(); ++id) {
+            auto it = oldIDs.find( newTable.item(id).first );
+            if (it != oldIDs.end()) {
+                toOld[id] = it->second;
+                toNew[it->second] = id;
+            } // if
+        } // for
+    }
+
+    auto within = []( double a, double b ) {
+        return fabs(a - b) <= g_fTolerance * max(fabs(a), fabs(b));
+    };
+
+    // a row as (new id, condFreq), in id order, or as listed with tolerance 0, where even ties must come in the same order
+    // for patch to rebuild the row exactly; false if the old row lists an item the new table does not have
+    auto concur_of = []( const TableRow &row, const vector<uint32_t> *renumber, const TableIndex &table,
+            vector< pair<uint32_t, double> > &concurItems ) {
+        concurItems.clear();
+        for (const auto &c : row.concurItems) {
+            // every item has a row, the targets of -source-prefix tables included, so an id without one is corrupt
+            if (c.first == 0 || c.first > table.size())
+                throw_runtime_error( stringstream() << table.filename() << ": item id " << c.first
+                        << " has no row; only tables with a row per item can be diffed" );
+            uint32_t id = renumber ? (*renumber)[c.first] : c.first;
+            if (!id)
+                return false;
+            concurItems.emplace_back( id, (double)c.second / row.count );
+        } // for
+        if (g_fTolerance > 0.0)
+            sort( concurItems.begin(), concurItems.end() );
+        return true;
+    };
+
+    ofstream ofs;
+    ostream &os = open_output(ofs);
+    os << DELTA_HEADER << " " << oldTable.size() << " " << newTable.size() << "\n";
+
+    TableRow oldRow, newRow;
+    string oldLine, newLine;
+    vector< pair<uint32_t, double> > oldConcur, newConcur;
+    uint32_t runStart = 0, runLength = 0;
+    uint64_t written = 0;
+
+    auto flush_run = [&] {
+        if (runLength)
+            os << DELTA_COPY << runStart << " " << runLength << "\n";
+        runLength = 0;
+    };
+
+    for (uint32_t id = 1; id <= newTable.size(); ++id) {
+        newTable.readRow(id, newLine);
+        bool same = false;
+        if (toOld[id]) {
+            oldTable.readRow(toOld[id], oldLine);
+            if (!parse_table_row(newLine, newRow) || !parse_table_row(oldLine, oldRow))
+                throw_runtime_error( stringstream() << "Malformed row of item " << newTable.item(id).first );
+            same = within(oldRow.count, newRow.count) && concur_of(oldRow, &toNew, oldTable, oldConcur);
+            concur_of(newRow, NULL, newTable, newConcur);
+            same = same && oldConcur.size() == newConcur.size();
+            for (size_t k = 0; same && k < newConcur.size(); ++k)
+                same = oldConcur[k].first == newConcur[k].first && within(oldConcur[k].second, newConcur[k].second);
+        } // if
+
+        if (same && runLength && runStart + runLength == toOld[id]) {
+            ++runLength;
+        } else if (same) {
+            flush_run();
+            runStart = toOld[id];
+            runLength = 1;
+        } else {
+            flush_run();
+            os << DELTA_ROW << newLine << "\n";
+            ++written;
+        } // if
+    } // for
+    flush_run();
+    os << flush;
+
+    cerr << "diff: " << written << " of " << newTable.size() << " rows written, "
+         << newTable.size() - written << " copied from the old table" << endl;
+}
+
+/*
+ * Rebuild the new table from the old table g_arrInputs[0] and the delta g_arrInputs[1] written by diff. A copied row has its
+ * concur ids renumbered, which needs the new id of every old item: a first pass over the delta collects them, the second
+ * writes the rows.
+ */
+static
+void do_patch_routine()
+{
+    using namespace std;
+
+    TableIndex oldTable(g_arrInputs[0]);
+    ifstream delta(g_arrInputs[1], ios::in | ios::binary);
+    if (!delta)
+        throw_runtime_error( stringstream() << "Cannot open delta " << g_arrInputs[1] );
+
+    string line, header, item;
+    uint64_t oldRows = 0, newRows = 0, count;
+    size_t end;
+    if (!getline(delta, line) || !(stringstream(line) >> header >> oldRows >> newRows) || header != DELTA_HEADER)
+        throw_runtime_error( stringstream() << g_arrInputs[1] << " is not a delta written by diff" );
+    if (oldRows != oldTable.size())
+        throw_runtime_error( stringstream() << g_arrInputs[1] << " is a delta from a table of " << oldRows
+                << " rows, " << g_arrInputs[0] << " has " << oldTable.size() );
+
+    auto parse_copy = [&]( const string &line, uint32_t &start, uint32_t &length ) {
+        if (sscanf(line.c_str() + 1, "%u %u", &start, &length) != 2 || !start || start + (uint64_t)length - 1 > oldRows)
+            throw_runtime_error( stringstream() << g_arrInputs[1] << ": bad copy line " << line );
+    };
+
+    // new id of every old item that is still in the table
+    vector<uint32_t> toNew(oldTable.size() + 1, 0);
+    {
+        unordered_map<string, uint32_t> oldIDs;
+        for (uint32_t id = 1; id <= oldTable.size(); ++id)
+            oldIDs.emplace( oldTable.item(id).first, id );
+        uint32_t newID = 0, start, length;
+        while (getline(delta, line)) {
+            if (line[0] == DELTA_COPY) {
+                parse_copy(line, start, length);
+                for (uint32_t k = 0; k < length; ++k)
+                    toNew[start + k] = ++newID;
+            } else if (line[0] == DELTA_ROW && parse_table_head(line.substr(1), item, count, end)) {
+                ++newID;
+                auto it = oldIDs.find(item);
+                if (it != oldIDs.end())
+                    toNew[it->second] = newID;
+            } else {
+                throw_runtime_error( stringstream() << g_arrInputs[1] << ": bad line " << line.substr(0, 64) );
+            } // if
+        } // while
+        if (newID != newRows)
+            throw_runtime_error( stringstream() << g_arrInputs[1] << " is truncated, " << newID << " of " << newRows << " rows" );
+    }
+
+    ofstream ofs;
+    ostream &os = open_output(ofs);
+    delta.clear();
+    delta.seekg(0);
+    getline(delta, line);
+
+    TableRow row;
+    string oldLine;
+    uint32_t start, length;
+    while (getline(delta, line)) {
+        if (line[0] == DELTA_ROW) {
+            os.write( line.data() + 1, line.size() - 1 );
+            os << "\n";
+            continue;
+        } // if
+        parse_copy(line, start, length);
+        for (uint32_t id = start; id < start + length; ++id) {
+            oldTable.readRow(id, oldLine);
+            if (!parse_table_row(oldLine, row))
+                throw_runtime_error( stringstream() << "Malformed row of item " << oldTable.item(id).first );
+            for (auto &c : row.concurItems) {
+                if (c.first == 0 || c.first > oldTable.size() || !toNew[c.first])
+                    throw_runtime_error( stringstream() << g_arrInputs[1] << " does not match " << g_arrInputs[0]
+                            << ": copied row of item " << row.item << " lists an item the new table lacks" );
+                c.first = toNew[c.first];
+            } // for
+            write_table_row( os, row.item, row.count, row.concurItems );
+        } // for id
+    } // while
+    os << flush;
+}
+
+static volatile sig_atomic_t g_bReload = 0;      // load: set by SIGHUP
+
+/*
+ * Serve a built table: every line of stdin is an item, answered with its row, the concur items by name. The table is
+ * mapped and indexed in one pass, its rows parsed per query (table_snapshot.h), and held by a SnapshotManager; on SIGHUP
+ * a background thread maps and indexes the file again and swaps it in, queries meanwhile reading whichever snapshot was
+ * current when they began, and the old mapping is released once the last of them is done.
+ */
 static
 void do_load_routine()
 {
+    using namespace std;
+
+    typedef SnapshotManager<TableSnapshot>  TableManager;
+
+    TableManager manager( new TableSnapshot(g_cstrInputData) );
+    atomic<bool> done(false);
+
+    {
+        TableManager::ReadGuard table(manager);
+        cerr << "load: serving " << g_cstrInputData << ", " << table->size() << " rows of "
+             << table->score() << " values" << endl;
+    }
+
+    signal(SIGHUP, []( int ) { g_bReload = 1; });
+
+    thread reloader( [&] {
+        while (!done.load()) {
+            if (g_bReload) {
+                g_bReload = 0;
+                try {
+                    TableSnapshot *pNext = new TableSnapshot(g_cstrInputData);
+                    manager.publish(pNext);
+                    cerr << "load: swapped in " << g_cstrInputData << ", " << pNext->size() << " rows of "
+                         << pNext->score() << " values" << endl;
+                } catch (const std::exception &ex) {
+                    cerr << "load: keeping the current table, " << ex.what() << endl;
+                } // try
+            } // if
+            manager.reclaim();
+            this_thread::sleep_for( chrono::milliseconds(100) );
+        } // while
+    } );
+
+    string item;
+    vector<TableSnapshot::ConcurItemInfo> concurItems;
+    while (getline(cin, item)) {
+        TableManager::ReadGuard table(manager);
+        uint32_t id = table->find(item), count = 0;
+        if (id)
+            count = table->row(id, concurItems);
+        else
+            concurItems.clear();
+        cout << item << ":" << count << "\t";
+        for (const auto &c : concurItems)
+            cout << (c.id && c.id <= table->size() ? table->item(c.id) : to_string(c.id)) << ":"
+                 << c.condCount << ":" << c.condFreq << " ";
+        cout << endl;
+    } // while
+
+    done = true;
+    reloader.join();
 }
 
 
@@ -305,12 +1287,21 @@ int main( int argc, char **argv )
     try {
         google::InitGoogleLogging(argv[0]);
 
-        g_pFreqDB.reset( new StringFreqDB(1, g_nTopK) );
-
-        if (g_eRunType == BUILD)
-            do_build_routine();
-        else
+        if (g_eRunType == BUILD && g_nIntTokens) {
+            g_pIdFreqDB.reset( new IdFreqDB(1, g_nTopK) );
+            do_build_routine( g_pIdFreqDB );
+        } else if (g_eRunType == BUILD) {
+            g_pFreqDB.reset( new StringFreqDB(1, g_nTopK) );
+            do_build_routine( g_pFreqDB );
+        } else if (g_eRunType == MERGE) {
+            do_merge_routine();
+        } else if (g_eRunType == DIFF) {
+            do_diff_routine();
+        } else if (g_eRunType == PATCH) {
+            do_patch_routine();
+        } else {
             do_load_routine();
+        } // if
 
     } catch (const std::exception &ex) {
         cerr << "main caught exception: " << ex.what() << endl;
@@ -0,0 +1,220 @@
+#ifndef _REVERSE_INDEX_H_
+#define _REVERSE_INDEX_H_
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <sstream>
+#include <algorithm>
+#include <exception>
+#include "error.h"
+
+/*
+ * Transposed top-K index of a build: for every item b, the items a with the largest P(b|a) = count(a, b) / count(a).
+ *
+ * The pairs arrive as the forward table is filled and are routed into buckets by b. Every pair comes once from cooccur,
+ * so the top-K of a bucket is the top-K of the top-Ks of its parts: a bucket is pruned to its best K per b whenever the
+ * buffers reach the memory bound, and appended to its temporary file only when pruning does not free enough. finish()
+ * merges each bucket's file with what is still buffered, buckets in parallel, and writes the rows in id order.
+ * The file is read back a chunk at a time and the bucket pruned after each, so a bucket in finish() holds at most K
+ * entries per b plus one chunk; the bound therefore needs a finite K (main() requires -topk with -reverse-o).
+ */
+class ReverseIndexBuilder {
+public:
+    struct Entry {
+        uint32_t    b;
+        uint32_t    a;
+        uint32_t    count;
+    };
+
+    // itemCounts[id] is count(id); memoryBytes bounds the buffered entries
+    ReverseIndexBuilder( const std::vector<uint32_t> &itemCounts, uint32_t topK, uint64_t memoryBytes,
+            uint32_t nThreads, const std::string &tempPrefix )
+            : m_arrCounts(itemCounts)
+            , m_nTopK(topK)
+            , m_nThreads(std::max(1u, nThreads))
+            , m_strTempPrefix(tempPrefix)
+            , m_nBuffered(0)
+    {
+        m_nMaxBuffered = std::max<uint64_t>( memoryBytes / sizeof(Entry), 1 << 16 );
+        m_nBuckets = (uint32_t)std::min<std::size_t>( 256, std::max<std::size_t>(1, itemCounts.size() / 1024) );
+        m_arrBuckets.resize(m_nBuckets);
+        m_arrSpilled.resize(m_nBuckets, 0);
+        m_arrCreated.resize(m_nBuckets, false);
+    }
+
+    // also on the way out of a failed build
+    ~ReverseIndexBuilder()
+    {
+        for (uint32_t k = 0; k < m_nBuckets; ++k)
+            if (m_arrCreated[k])
+                ::remove(tempFilename(k).c_str());
+    }
+
+    // the pair of forward row a with count
+    void add( uint32_t a, uint32_t b, uint32_t count )
+    {
+        m_arrBuckets[bucketOf(b)].push_back( Entry{b, a, count} );
+        if (++m_nBuffered >= m_nMaxBuffered)
+            compact();
+    }
+
+    /*
+     * Call writeRow(os, b, first, last) for every id b from 1 on, first..last being its entries, best first. The
+     * rows of a wave of m_nThreads buckets are formatted in parallel, writeRow only reading shared data, then written.
+     */
+    template <typename WriteRow>
+    void finish( std::ostream &os, WriteRow writeRow )
+    {
+        for (uint32_t first = 0; first < m_nBuckets; first += m_nThreads) {
+            uint32_t n = std::min(m_nThreads, m_nBuckets - first);
+            std::vector<std::string> output(n);
+            parallel( n, [&]( uint32_t i ) {
+                uint32_t k = first + i;
+                std::vector<Entry> &bucket = m_arrBuckets[k];
+                prune(bucket);
+                if (m_arrSpilled[k])
+                    mergeSpill(k, bucket);
+
+                std::stringstream str;
+                auto it = bucket.begin();
+                uint32_t lo = std::max<uint32_t>(1, bucketStart(k)), hi = bucketStart(k + 1);
+                for (uint32_t b = lo; b < hi; ++b) {
+                    auto end = it;
+                    while (end != bucket.end() && end->b == b)
+                        ++end;
+                    writeRow(str, b, it, end);
+                    it = end;
+                } // for b
+                std::vector<Entry>().swap(bucket);
+                output[i] = str.str();
+            } );
+            for (auto &rows : output)
+                os << rows;
+        } // for first
+    }
+
+private:
+    uint32_t bucketOf( uint32_t b ) const
+    { return (uint32_t)((uint64_t)b * m_nBuckets / m_arrCounts.size()); }
+
+    // smallest b of bucket k
+    uint32_t bucketStart( uint32_t k ) const
+    { return (uint32_t)(((uint64_t)k * m_arrCounts.size() + m_nBuckets - 1) / m_nBuckets); }
+
+    std::string tempFilename( uint32_t k ) const
+    {
+        std::stringstream str;
+        str << m_strTempPrefix << "_" << k << ".bin";
+        return str.str();
+    }
+
+    // by b, then the larger P(b|a), compared exactly by cross-multiplying, ties to the smaller a
+    bool before( const Entry &x, const Entry &y ) const
+    {
+        if (x.b != y.b)
+            return x.b < y.b;
+        uint64_t lhs = (uint64_t)x.count * m_arrCounts[y.a], rhs = (uint64_t)y.count * m_arrCounts[x.a];
+        return lhs != rhs ? lhs > rhs : x.a < y.a;
+    }
+
+    // keep the best m_nTopK entries of every b, grouped by b
+    void prune( std::vector<Entry> &bucket ) const
+    {
+        std::sort( bucket.begin(), bucket.end(), [this]( const Entry &x, const Entry &y ) { return before(x, y); } );
+        std::size_t n = 0, run = 0;
+        for (std::size_t i = 0; i < bucket.size(); ++i) {
+            run = (i > 0 && bucket[i].b == bucket[i - 1].b) ? run + 1 : 0;
+            if (run < m_nTopK)
+                bucket[n++] = bucket[i];
+        } // for
+        bucket.resize(n);
+    }
+
+    // prune every bucket; what still takes more than half the bound goes to the temporary files
+    void compact()
+    {
+        parallel( m_nBuckets, [&]( uint32_t k ) { prune(m_arrBuckets[k]); } );
+        uint64_t total = 0;
+        for (const auto &bucket : m_arrBuckets)
+            total += bucket.size();
+        if (total * 2 > m_nMaxBuffered) {
+            for (uint32_t k = 0; k < m_nBuckets; ++k) {
+                std::vector<Entry> &bucket = m_arrBuckets[k];
+                if (bucket.empty())
+                    continue;
+                // the first spill truncates whatever an earlier run may have left under the name
+                FILE *fp = ::fopen(tempFilename(k).c_str(), m_arrCreated[k] ? "ab" : "wb");
+                if (fp)
+                    m_arrCreated[k] = true;
+                bool ok = fp && ::fwrite(bucket.data(), sizeof(Entry), bucket.size(), fp) == bucket.size();
+                if ((fp && ::fclose(fp) != 0) || !ok)
+                    throw_runtime_error( std::stringstream() << "Cannot write " << tempFilename(k) );
+                m_arrSpilled[k] += bucket.size();
+                std::vector<Entry>().swap(bucket);
+            } // for k
+            total = 0;
+        } // if
+        m_nBuffered = total;
+    }
+
+    // merge the temporary file of bucket k into it; the m_nThreads buckets of a wave share the memory bound
+    void mergeSpill( uint32_t k, std::vector<Entry> &bucket ) const
+    {
+        const uint64_t chunk = std::max<uint64_t>( m_nMaxBuffered / m_nThreads, 1 << 12 );
+        FILE *fp = ::fopen(tempFilename(k).c_str(), "rb");
+        if (!fp)
+            throw_runtime_error( std::stringstream() << "Cannot read " << tempFilename(k) );
+        for (uint64_t left = m_arrSpilled[k]; left > 0; ) {
+            std::size_t n = bucket.size(), m = (std::size_t)std::min(chunk, left);
+            bucket.resize(n + m);
+            if (::fread(bucket.data() + n, sizeof(Entry), m, fp) != m) {
+                ::fclose(fp);
+                throw_runtime_error( std::stringstream() << "Cannot read " << tempFilename(k) );
+            } // if
+            left -= m;
+            prune(bucket);
+        } // for
+        ::fclose(fp);
+    }
+
+    // run job(0 .. n-1) on m_nThreads threads, rethrowing the first failure
+    template <typename Job>
+    void parallel( uint32_t n, Job job )
+    {
+        std::vector<std::thread> workers;
+        std::vector<std::exception_ptr> errors;
+        errors.resize(m_nThreads);
+        for (uint32_t w = 0; w < m_nThreads; ++w)
+            workers.emplace_back( [&, w] {
+                try {
+                    for (uint32_t i = w; i < n; i += m_nThreads)
+                        job(i);
+                } catch (...) {
+                    errors[w] = std::current_exception();
+                } // try
+            } );
+        for (auto &worker : workers)
+            worker.join();
+        for (auto &error : errors)
+            if (error)
+                std::rethrow_exception(error);
+    }
+
+private:
+    const std::vector<uint32_t>         &m_arrCounts;
+    const uint32_t                      m_nTopK;
+    const uint32_t                      m_nThreads;
+    const std::string                   m_strTempPrefix;
+    uint32_t                            m_nBuckets;
+    uint64_t                            m_nMaxBuffered;
+    uint64_t                            m_nBuffered;
+    std::vector< std::vector<Entry> >   m_arrBuckets;
+    std::vector<uint64_t>               m_arrSpilled;   // entries in the temporary file of each bucket
+    std::vector<bool>                   m_arrCreated;   // the temporary file of the bucket was created by this run
+};
+
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef _SNAPSHOT_MANAGER_H_
+#define _SNAPSHOT_MANAGER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+
+/*
+ * Read-mostly holder of the current Snapshot, swapped atomically while readers go on.
+ *
+ * Epoch-based reclamation: a reader announces the global epoch in a free slot, then loads the current pointer, and
+ * clears the slot when done; neither side takes a lock. publish() swaps the pointer, then advances the epoch, and
+ * retires the old snapshot with the epoch it was current in. A reader that announced a later epoch loaded the pointer
+ * after the swap, so a retired snapshot is freed once every busy slot shows a later epoch than its own.
+ */
+template <typename Snapshot>
+class SnapshotManager {
+public:
+    static const std::size_t MAX_READERS = 128;     // readers inside a ReadGuard at the same time
+
+    // pins the current snapshot for its lifetime
+    class ReadGuard {
+    public:
+        explicit ReadGuard( SnapshotManager &manager )
+                : m_pSlot(manager.enter())
+                , m_pSnapshot(manager.m_pCurrent.load())
+        {}
+
+        ~ReadGuard()
+        { m_pSlot->store(0, std::memory_order_release); }
+
+        ReadGuard( const ReadGuard& ) = delete;
+        ReadGuard& operator=( const ReadGuard& ) = delete;
+
+        const Snapshot* get() const
+        { return m_pSnapshot; }
+        const Snapshot* operator->() const
+        { return m_pSnapshot; }
+
+    private:
+        std::atomic<uint64_t>   *m_pSlot;
+        const Snapshot          *m_pSnapshot;
+    };
+
+public:
+    explicit SnapshotManager( Snapshot *pInitial = NULL )
+            : m_pCurrent(pInitial), m_nEpoch(1)
+    {
+        for (auto &slot : m_arrSlots)
+            slot.epoch.store(0);
+    }
+
+    // no ReadGuard may be alive any more
+    ~SnapshotManager()
+    {
+        delete m_pCurrent.load();
+        for (auto &retired : m_arrRetired)
+            delete retired.first;
+    }
+
+    SnapshotManager( const SnapshotManager& ) = delete;
+    SnapshotManager& operator=( const SnapshotManager& ) = delete;
+
+    // make pNext, which the manager takes over, the current snapshot; the old one is freed once no reader holds it
+    void publish( Snapshot *pNext )
+    {
+        std::lock_guard<std::mutex> lock(m_mtxWriter);
+        Snapshot *pOld = m_pCurrent.exchange(pNext);
+        uint64_t epoch = m_nEpoch.fetch_add(1);
+        if (pOld)
+            m_arrRetired.emplace_back( pOld, epoch );
+        reclaimLocked();
+    }
+
+    // free the retired snapshots no reader can hold any more; returns how many are still waiting
+    std::size_t reclaim()
+    {
+        std::lock_guard<std::mutex> lock(m_mtxWriter);
+        return reclaimLocked();
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch;    // epoch announced by the reader in the slot, 0 for a free slot
+    };
+
+    std::atomic<uint64_t>* enter()
+    {
+        std::size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+        for (std::size_t i = 0; ; ++i) {
+            std::atomic<uint64_t> &slot = m_arrSlots[(start + i) % MAX_READERS].epoch;
+            uint64_t expected = 0;
+            // an epoch that is already stale when it lands only delays reclamation
+            if (slot.load(std::memory_order_relaxed) == 0 && slot.compare_exchange_strong(expected, m_nEpoch.load()))
+                return &slot;
+            if (i % MAX_READERS == MAX_READERS - 1)
+                std::this_thread::yield();
+        } // for
+    }
+
+    std::size_t reclaimLocked()
+    {
+        uint64_t oldest = UINT64_MAX;
+        for (auto &slot : m_arrSlots) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch && epoch < oldest)
+                oldest = epoch;
+        } // for
+        std::size_t n = 0;
+        for (auto &retired : m_arrRetired) {
+            if (retired.second < oldest)
+                delete retired.first;
+            else
+                m_arrRetired[n++] = retired;
+        } // for
+        m_arrRetired.resize(n);
+        return n;
+    }
+
+private:
+    Slot                                            m_arrSlots[MAX_READERS];
+    std::atomic<Snapshot*>                          m_pCurrent;
+    std::atomic<uint64_t>                           m_nEpoch;
+    std::mutex                                      m_mtxWriter;
+    std::vector< std::pair<Snapshot*, uint64_t> >   m_arrRetired;   // (snapshot, epoch it was current in)
+};
+
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef _TABLE_IO_H_
+#define _TABLE_IO_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ostream>
+#include "error.h"
+
+/*
+ * Built tables as dump_db() writes them, one row per item in id order:
+ *      item:count\tid:condCount:condFreq id:condCount:condFreq ...
+ * so the row on line k (from 1) is the item with id k, and the ids of the concur items refer to those lines.
+ * A -scores table ranked by anything but P(b|a) starts with a line naming its score, e.g. "#itemfreq-score lift", its rows
+ * holding that score in place of condFreq; the line is not counted, the first row after it is still id 1.
+ */
+#define SCORE_HEADER    "#itemfreq-score"
+
+struct TableRow {
+    std::string     item;
+    uint64_t        count;
+    std::vector< std::pair<uint32_t, uint64_t> > concurItems;  // (id, condCount)
+};
+
+// split "item:count" off the front of line; the item may itself hold ':', the count is after the last one before the tab
+inline
+bool parse_table_head( const std::string &line, std::string &item, uint64_t &count, std::size_t &end )
+{
+    end = line.find('\t');
+    if (end == std::string::npos)
+        end = line.size();
+    std::size_t colon = line.rfind(':', end);
+    if (colon == std::string::npos || colon + 1 >= end)
+        return false;
+    char *stop;
+    count = strtoull(line.c_str() + colon + 1, &stop, 10);
+    if (stop != line.c_str() + end)
+        return false;
+    item.assign(line, 0, colon);
+    return true;
+}
+
+// the score named by a SCORE_HEADER line, false if line is a table row
+inline
+bool parse_score_header( const std::string &line, std::string &score )
+{
+    std::size_t len = sizeof(SCORE_HEADER) - 1;
+    if (line.compare(0, len, SCORE_HEADER) != 0 || (line.size() > len && line[len] != ' '))
+        return false;
+    score.assign(line, line.size() > len ? len + 1 : len, std::string::npos);
+    while (!score.empty() && (score.back() == '\r' || score.back() == ' '))
+        score.pop_back();
+    return true;
+}
+
+// parse a whole row; condFreq is dropped, it is condCount / count
+inline
+bool parse_table_row( const std::string &line, TableRow &row )
+{
+    std::size_t end;
+    row.concurItems.clear();
+    if (!parse_table_head(line, row.item, row.count, end))
+        return false;
+
+    const char *p = line.c_str() + end, *stop = line.c_str() + line.size();
+    char *next;
+    while (p < stop) {
+        while (p < stop && (*p == '\t' || *p == ' ' || *p == '\r'))
+            ++p;
+        if (p == stop)
+            break;
+        unsigned long id = strtoul(p, &next, 10);
+        if (next == p || *next != ':')
+            return false;
+        p = next + 1;
+        uint64_t condCount = strtoull(p, &next, 10);
+        if (next == p || *next != ':')
+            return false;
+        p = next + 1;
+        strtod(p, &next);
+        if (next == p)
+            return false;
+        p = next;
+        row.concurItems.emplace_back( (uint32_t)id, condCount );
+    } // while
+    return true;
+}
+
+// the inverse of parse_table_row() for rows whose concurItems are already ordered, with condFreq recomputed
+inline
+void write_table_row( std::ostream &os, const std::string &item, uint64_t count,
+        const std::vector< std::pair<uint32_t, uint64_t> > &concurItems )
+{
+    os << item << ":" << count << "\t";
+    for (const auto &c : concurItems)
+        os << c.first << ":" << c.second << ":" << (double)c.second / count << " ";
+    os << "\n";
+}
+
+
+/*
+ * One input table of a merge: the item and count of every row and where the row starts, read in one pass, so that
+ * rows can later be fetched in any order without holding the pairs in memory.
+ * Only P(b|a) tables are accepted, merge, diff and patch recompute condFreq from the counts.
+ */
+class TableIndex {
+public:
+    explicit TableIndex( const std::string &filename )
+            : m_strFilename(filename)
+            , m_ifs(filename, std::ios::in | std::ios::binary)
+    {
+        if (!m_ifs)
+            throw_runtime_error( std::stringstream() << "Cannot open table " << filename );
+
+        std::string line, item;
+        uint64_t    count, offset = 0;
+        std::size_t end;
+        while (std::getline(m_ifs, line)) {
+            if (offset == 0 && parse_score_header(line, item))
+                throw_runtime_error( std::stringstream() << filename << " holds " << item
+                        << " scores, not P(b|a); only cond tables can be merged, diffed or patched" );
+            if (!parse_table_head(line, item, count, end))
+                throw_runtime_error( std::stringstream() << filename << ":" << m_arrItems.size() + 1
+                        << ": not a table row" );
+            m_arrItems.emplace_back( std::move(item), count );
+            m_arrOffsets.push_back( offset );
+            offset += line.size() + 1;
+        } // while
+        m_ifs.clear();
+    }
+
+    const std::string& filename() const
+    { return m_strFilename; }
+
+    // number of rows; ids run from 1 to size()
+    std::size_t size() const
+    { return m_arrItems.size(); }
+
+    const std::pair<std::string, uint64_t>& item( uint32_t id ) const
+    { return m_arrItems[id - 1]; }
+
+    // fetch the raw row of id; sequential ids read sequentially
+    void readRow( uint32_t id, std::string &line )
+    {
+        if (m_nNextID != id)
+            m_ifs.seekg( m_arrOffsets[id - 1] );
+        if (!std::getline(m_ifs, line))
+            throw_runtime_error( std::stringstream() << m_strFilename << ": cannot read row " << id );
+        m_nNextID = id + 1;
+    }
+
+private:
+    std::string                                         m_strFilename;
+    std::ifstream                                       m_ifs;
+    std::vector< std::pair<std::string, uint64_t> >     m_arrItems;
+    std::vector<uint64_t>                               m_arrOffsets;
+    uint32_t                                            m_nNextID = 0;     // id of the row the stream is at, 0 if unknown
+};
+
+
+/*
+ * Deltas written by diff and applied by patch, turning an old table into a new one row by row:
+ *      #itemfreq-delta <old rows> <new rows>
+ *      =<old id> <n>           the next n rows of the new table are old rows <old id> .. <old id> + n - 1, their ids renumbered
+ *      +<row>                  the next row of the new table, as it is written there
+ */
+#define DELTA_HEADER    "#itemfreq-delta"
+#define DELTA_COPY      '='
+#define DELTA_ROW       '+'
+
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef _TABLE_SNAPSHOT_H_
+#define _TABLE_SNAPSHOT_H_
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "item_freq.h"
+#include "table_io.h"
+#include "error.h"
+
+/*
+ * A built table (format in table_io.h) mapped read-only for serving. Opening it reads the whole file once, recording
+ * where every row starts and hashing the items for lookup, so it costs time in proportion to the table; the concur items
+ * of a row are only parsed when it is queried.
+ * The mapping pins the file's inode, so a rebuilt table must replace the file by rename(), not be written over it.
+ * A -scores table names its score on a first SCORE_HEADER line, which is skipped; other tables hold P(b|a), "cond".
+ */
+class TableSnapshot {
+public:
+    typedef ItemFreqDB<std::string>::ConcurItemInfo   ConcurItemInfo;
+
+    explicit TableSnapshot( const std::string &filename )
+            : m_strFilename(filename), m_pData(NULL), m_nSize(0)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw_runtime_error( std::stringstream() << "Cannot open table " << filename );
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw_runtime_error( std::stringstream() << "Cannot stat table " << filename );
+        } // if
+        m_nSize = st.st_size;
+        if (m_nSize > 0) {
+            void *p = ::mmap(NULL, m_nSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw_runtime_error( std::stringstream() << "Cannot map table " << filename );
+            } // if
+            m_pData = (const char*)p;
+        } // if
+        ::close(fd);
+
+        ::madvise((void*)m_pData, m_nSize, MADV_SEQUENTIAL);
+        buildIndex();
+        ::madvise((void*)m_pData, m_nSize, MADV_RANDOM);
+    }
+
+    ~TableSnapshot()
+    {
+        if (m_pData)
+            ::munmap((void*)m_pData, m_nSize);
+    }
+
+    TableSnapshot( const TableSnapshot& ) = delete;
+    TableSnapshot& operator=( const TableSnapshot& ) = delete;
+
+    const std::string& filename() const
+    { return m_strFilename; }
+
+    // number of rows; ids run from 1 to size()
+    std::size_t size() const
+    { return m_arrRowStart.size(); }
+
+    // the score in the condFreq field of the rows
+    const std::string& score() const
+    { return m_strScore; }
+
+    std::string item( uint32_t id ) const
+    { return std::string(m_pData + m_arrRowStart[id - 1], m_arrItemLen[id - 1]); }
+
+    // id of item, 0 if the table has no row for it
+    uint32_t find( const std::string &item ) const
+    {
+        uint64_t h = hash(item.data(), item.size());
+        for (std::size_t pos = h & m_nMask; m_arrSlots[pos]; pos = (pos + 1) & m_nMask) {
+            uint32_t id = m_arrSlots[pos];
+            if (m_arrItemLen[id - 1] == item.size() && memcmp(m_pData + m_arrRowStart[id - 1], item.data(), item.size()) == 0)
+                return id;
+        } // for
+        return 0;
+    }
+
+    // parse row id: the item's count and its concur items in table order, condFreq being the value the table was
+    // ranked by (P(b|a), or the score of a -scores table)
+    uint32_t row( uint32_t id, std::vector<ConcurItemInfo> &concurItems ) const
+    {
+        const char *p = m_pData + m_arrRowStart[id - 1] + m_arrItemLen[id - 1] + 1;
+        const char *end = id < size() ? m_pData + m_arrRowStart[id] : m_pData + m_nSize;
+        uint64_t count = 0, concurID, condCount;
+        char field[32];
+
+        concurItems.clear();
+        p = parseNumber(p, end, count);
+        while (p < end) {
+            while (p < end && (*p == '\t' || *p == ' ' || *p == '\r' || *p == '\n'))
+                ++p;
+            if (p == end)
+                break;
+            p = parseNumber(p, end, concurID);
+            p = parseNumber(p + 1, end, condCount);
+            // the mapping is not NUL-terminated, so the field is copied out for strtod()
+            std::size_t len = 0;
+            for (++p; p < end && *p != ' ' && *p != '\n'; ++p)
+                if (len + 1 < sizeof(field))
+                    field[len++] = *p;
+            field[len] = 0;
+            concurItems.emplace_back( (uint32_t)concurID, (uint32_t)condCount, strtod(field, NULL) );
+        } // while
+        return (uint32_t)count;
+    }
+
+private:
+    static uint64_t hash( const char *s, std::size_t len )
+    {
+        uint64_t h = 14695981039346656037ULL;    // FNV-1a
+        for (std::size_t i = 0; i < len; ++i)
+            h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+        return h;
+    }
+
+    static const char* parseNumber( const char *p, const char *end, uint64_t &value )
+    {
+        value = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p)
+            value = value * 10 + (*p - '0');
+        return p;
+    }
+
+    // row starts, item lengths (up to the last ':' before the tab) and the open-addressing item hash
+    void buildIndex()
+    {
+        const char *p = m_pData, *end = m_pData + m_nSize;
+        if (p < end) {
+            const char *eol = (const char*)memchr(p, '\n', end - p);
+            if (!eol)
+                eol = end;
+            if (parse_score_header(std::string(p, eol - p), m_strScore))
+                p = eol + 1;
+        } // if
+        while (p < end) {
+            const char *eol = (const char*)memchr(p, '\n', end - p);
+            if (!eol)
+                eol = end;
+            const char *tab = (const char*)memchr(p, '\t', eol - p);
+            const char *colon = tab ? tab : eol;
+            while (colon > p && *--colon != ':');
+            if (*colon != ':')
+                throw_runtime_error( std::stringstream() << m_strFilename << ":" << size() + 1 << ": not a table row" );
+            m_arrRowStart.push_back( p - m_pData );
+            m_arrItemLen.push_back( colon - p );
+            p = eol + 1;
+        } // while
+
+        std::size_t n = 16;
+        while (n < 2 * size())
+            n <<= 1;
+        m_arrSlots.assign(n, 0);
+        m_nMask = n - 1;
+        for (uint32_t id = 1; id <= size(); ++id) {
+            std::size_t pos = hash(m_pData + m_arrRowStart[id - 1], m_arrItemLen[id - 1]) & m_nMask;
+            while (m_arrSlots[pos])
+                pos = (pos + 1) & m_nMask;
+            m_arrSlots[pos] = id;
+        } // for
+    }
+
+private:
+    std::string             m_strFilename;
+    std::string             m_strScore = "cond";
+    const char              *m_pData;
+    std::size_t             m_nSize;
+    std::vector<uint64_t>   m_arrRowStart;
+    std::vector<uint32_t>   m_arrItemLen;
+    std::vector<uint32_t>   m_arrSlots;     // id by hash of its item, 0 for a free slot
+    std::size_t             m_nMask;
+};
+
+
+#endif